@@ -0,0 +1,40 @@
+#ifndef JOS_INC_E820_H
+#define JOS_INC_E820_H
+
+// The BIOS memory map, as returned by INT 15h, EAX=E820h.
+//
+// boot/boot.S collects the map in real mode and leaves it at physical
+// address E820_MAP_PA: a 32-bit entry count followed by the entries.
+// The kernel copies it out in i386_detect_memory, before that page can
+// be reused.
+
+#define E820_MAP_PA	0x8000		// Just past the boot sector
+#define E820_MAX	32		// Most entries the boot loader collects
+#define E820_ENTSIZE	20		// Bytes per entry
+#define E820_SMAP	0x534d4150	// 'SMAP' signature for INT 15h
+
+// Entry types
+#define E820_RAM	1		// Usable RAM
+#define E820_RESERVED	2		// Reserved by the firmware or hardware
+#define E820_ACPI	3		// ACPI tables, reclaimable once read
+#define E820_NVS	4		// ACPI non-volatile storage
+#define E820_UNUSABLE	5		// Faulty RAM
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+struct E820Entry {
+	uint64_t addr;			// Start of the range
+	uint64_t len;			// Length of the range in bytes
+	uint32_t type;			// E820_*
+} __attribute__((packed));
+
+struct E820Map {
+	uint32_t nr;			// Number of valid entries
+	struct E820Entry map[E820_MAX];
+} __attribute__((packed));
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_E820_H */
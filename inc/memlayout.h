@@ -43,7 +43,11 @@
  *                     +------------------------------+                   |
  *                     :              .               :                   |
  *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *                     +------------------------------+                   |
+ *                     |  Profiler buffers (PROFBASE) | RW/--             |
+ *                     +------------------------------+                   |
+ *                     |  Highmem kmap slots (NKMAP)  | RW/--             |
+ *  MMIOLIM,KMAPBASE>  +------------------------------+ 0xefc00000      --+
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
@@ -92,6 +96,10 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// boot_aps copies the AP entry code (kern/mpentry.S) to this physical
+// page, which page_init leaves off the free lists.
+#define MPENTRY_PADDR	0x7000
+
 // Kernel stack.
 #define KSTACKTOP	KERNBASE
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
@@ -101,6 +109,15 @@
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
 #define MMIOBASE	(MMIOLIM - PTSIZE)
 
+// Temporary kernel mappings of physical memory beyond the KERNBASE map
+// (see kmap() in kern/pmap.c), below the kernel stacks.
+#define KMAPBASE	MMIOLIM
+#define NKMAP		64
+
+// The profiler's per-CPU sample buffers (see kern/prof.c), between the
+// kmap slots and the kernel stacks.
+#define PROFBASE	(KMAPBASE + NKMAP * PGSIZE)
+
 #define ULIM		(MMIOBASE)
 
 /*
@@ -143,7 +160,6 @@
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
 
-#if JOS_USER
 /*
  * The page directory entry corresponding to the virtual address range
  * [UVPT, UVPT + PTSIZE) points to the page directory itself.  Thus, the page
@@ -151,16 +167,18 @@ typedef uint32_t pde_t;
  *
  * One result of treating the page directory as a page table is that all PTEs
  * can be accessed through a "virtual page table" at virtual address UVPT (to
- * which uvpt is set in lib/entry.S).  The PTE for page number N is stored in
+ * which uvpt is set in lib/entry.S and kern/entry.S).  The PTE for page number N is stored in
  * uvpt[N].  (It's worth drawing a diagram of this!)
  *
  * A second consequence is that the contents of the current page directory
  * will always be available at virtual address (UVPT + (UVPT >> PGSHIFT)), to
- * which uvpd is set in lib/entry.S.
+ * which uvpd is set in lib/entry.S and kern/entry.S.
+ *
+ * The mapping is read-only even to the kernel (CR0_WP is set), so the
+ * kernel only reads page tables through it.
  */
 extern volatile pte_t uvpt[];     // VA of "virtual page table"
 extern volatile pde_t uvpd[];     // VA of current page directory
-#endif
 
 /*
  * Page descriptor structures, mapped at UPAGES.
@@ -182,6 +200,27 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// What the page is used for (PAGE_* below).
+	uint8_t pp_owner;
+
+	// For a page table (pp_owner == PAGE_PGTABLE), the number of
+	// present entries in it.
+	uint16_t pp_nlive;
+};
+
+// Values of PageInfo.pp_owner.
+enum {
+	PAGE_FREE = 0,		// On the free list
+	PAGE_RESERVED,		// Page 0, MPENTRY_PADDR, and memory the BIOS map doesn't list usable
+	PAGE_IOHOLE,		// [IOPHYSMEM, EXTPHYSMEM)
+	PAGE_KERNEL,		// Kernel image, [EXTPHYSMEM, end)
+	PAGE_BOOT,		// Allocated by boot_alloc
+	PAGE_PGTABLE,		// Page table allocated by pgdir_walk
+	PAGE_USER,		// Mapped below UTOP by page_insert
+	PAGE_SLAB,		// Slab of a kmem cache
+	PAGE_ALLOC,		// Any other page from page_alloc
+	NPAGE_OWNERS
 };
 
 #endif /* !__ASSEMBLER__ */
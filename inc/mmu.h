@@ -67,7 +67,8 @@
 
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
-#define PTE_AVAIL	0xE00	// Available for software use
+// Bit 0x200 is kept back for the kernel's PTE_COW (see kern/pmap.h).
+#define PTE_AVAIL	0xC00	// Available for software use
 
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
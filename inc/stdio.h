@@ -1,31 +1,76 @@
 #ifndef JOS_INC_STDIO_H
 #define JOS_INC_STDIO_H
 
+#include <inc/types.h>
 #include <inc/stdarg.h>
 
 #ifndef NULL
 #define NULL	((void *) 0)
 #endif /* !NULL */
 
+// Let gcc's -Wformat check arguments against printf-style format strings.
+#define __printf_like(f, a)	__attribute__((__format__(__printf__, f, a)))
+
+// A format string pre-parsed into literal spans and conversions.
+// Each CPRINTF_CACHED call site owns one, filled in on first use,
+// so later calls skip re-scanning the format character by character.
+#define FMT_MAXSEGS	16
+
+struct Fmtseg {
+	const char *lit;	// start of literal span, or NULL for a conversion
+	int len;		// length of literal span
+	char conv;		// conversion character ('d', 's', ...)
+	char padc;		// pad character
+	char lflag;		// number of 'l' modifiers
+	char altflag;		// '#' seen
+	int width;
+	int precision;
+};
+
+struct Fmtcache {
+	const char *fmt;
+	int nsegs;		// 0 = not parsed yet, -1 = use vprintfmt
+	struct Fmtseg segs[FMT_MAXSEGS];
+};
+
 // lib/console.c
 void	cputchar(int c);
+void	cputs(const char *s, size_t len);
 int	getchar(void);
 int	iscons(int fd);
 
 // lib/printfmt.c
-void	printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...);
-void	vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list);
-int	snprintf(char *str, int size, const char *fmt, ...);
-int	vsnprintf(char *str, int size, const char *fmt, va_list);
+void	printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...) __printf_like(3, 4);
+void	vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list) __printf_like(3, 0);
+void	vprintfmt_cached(void (*putch)(int, void*), void (*putspan)(const char*, size_t, void*), void *putdat, struct Fmtcache *fc, va_list);
+int	snprintf(char *str, int size, const char *fmt, ...) __printf_like(3, 4);
+int	vsnprintf(char *str, int size, const char *fmt, va_list) __printf_like(3, 0);
 
 // lib/printf.c
-int	cprintf(const char *fmt, ...);
-int	vcprintf(const char *fmt, va_list);
+int	cprintf(const char *fmt, ...) __printf_like(1, 2);
+int	vcprintf(const char *fmt, va_list) __printf_like(1, 0);
+int	cprintf_cached(struct Fmtcache *fc, ...);
+
+// CPRINTF_CACHED(fmt, ...) behaves like cprintf(fmt, ...) for a literal
+// 'fmt', but is cheap enough for hot paths: a format with no '%' is
+// recognized at compile time and written out in one span, and any other
+// format is parsed once per call site rather than once per call.
+// The dead cprintf() call keeps -Wformat checking the arguments.
+#define CPRINTF_CACHED(fmt, ...)					\
+({									\
+	static struct Fmtcache __fc = { "" fmt };			\
+	if (0)								\
+		cprintf(fmt, ##__VA_ARGS__);				\
+	if (__builtin_strchr("" fmt, '%') == NULL)			\
+		cputs(fmt, sizeof(fmt) - 1);				\
+	else								\
+		cprintf_cached(&__fc, ##__VA_ARGS__);			\
+})
 
 // lib/fprintf.c
-int	printf(const char *fmt, ...);
-int	fprintf(int fd, const char *fmt, ...);
-int	vfprintf(int fd, const char *fmt, va_list);
+int	printf(const char *fmt, ...) __printf_like(1, 2);
+int	fprintf(int fd, const char *fmt, ...) __printf_like(2, 3);
+int	vfprintf(int fd, const char *fmt, va_list) __printf_like(2, 0);
 
 // lib/readline.c
 char*	readline(const char *prompt);
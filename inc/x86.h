@@ -2,6 +2,7 @@
 #define JOS_INC_X86_H
 
 #include <inc/types.h>
+#include <inc/mmu.h>
 
 static inline void
 breakpoint(void)
@@ -201,10 +202,59 @@ read_eflags(void)
 	return eflags;
 }
 
+#if defined(JOS_KERNEL) && defined(IRQSOFF_TRACE)
+// The interrupts-off tracer (kern/irqsoff.c), enabled with
+// 'make DEFS=-DIRQSOFF_TRACE'.  The wrappers below call irqsoff_begin
+// right after they turn interrupts off and irqsoff_end right before
+// they turn them back on.
+void irqsoff_begin(void);
+void irqsoff_end(void);
+#define IRQSOFF_TRACING	1
+#else
+#define IRQSOFF_TRACING	0
+static inline void irqsoff_begin(void) { }
+static inline void irqsoff_end(void) { }
+#endif
+
+static inline void
+cli(void)
+{
+	uint32_t eflags = IRQSOFF_TRACING ? read_eflags() : 0;
+
+	asm volatile("cli" ::: "memory");
+	if (IRQSOFF_TRACING && (eflags & FL_IF))
+		irqsoff_begin();
+}
+
+static inline void
+sti(void)
+{
+	if (IRQSOFF_TRACING && !(read_eflags() & FL_IF))
+		irqsoff_end();
+	asm volatile("sti" ::: "memory");
+}
+
+// Enable interrupts and wait for one.  sti takes effect only after the
+// next instruction, so an interrupt already pending wakes the hlt
+// rather than being taken just before it.
+static inline void
+sti_hlt(void)
+{
+	if (IRQSOFF_TRACING && !(read_eflags() & FL_IF))
+		irqsoff_end();
+	asm volatile("sti; hlt" ::: "memory");
+}
+
 static inline void
 write_eflags(uint32_t eflags)
 {
-	asm volatile("pushl %0; popfl" : : "r" (eflags));
+	uint32_t old = IRQSOFF_TRACING ? read_eflags() : 0;
+
+	if (IRQSOFF_TRACING && !(old & FL_IF) && (eflags & FL_IF))
+		irqsoff_end();
+	asm volatile("pushl %0; popfl" : : "r" (eflags) : "memory", "cc");
+	if (IRQSOFF_TRACING && (old & FL_IF) && !(eflags & FL_IF))
+		irqsoff_begin();
 }
 
 static inline uint32_t
@@ -248,6 +298,28 @@ read_tsc(void)
 	return tsc;
 }
 
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static inline uint64_t
+rdpmc(uint32_t counter)
+{
+	uint64_t val;
+	asm volatile("rdpmc" : "=A" (val) : "c" (counter));
+	return val;
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -261,4 +333,36 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add 'inc' to *addr and return the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (inc), "+m" (*addr)
+		     :
+		     : "cc", "memory");
+	return inc;
+}
+
+// Atomically set *addr to 'newval' if it equals 'old'.  Returns the
+// value *addr had, which is 'old' on success.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t old, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (result), "+m" (*addr)
+		     : "r" (newval), "0" (old)
+		     : "cc", "memory");
+	return result;
+}
+
+// Spin-wait hint: lets the other hyperthread run and saves power.
+static inline void
+pause(void)
+{
+	asm volatile("pause" ::: "memory");
+}
+
 #endif /* !JOS_INC_X86_H */
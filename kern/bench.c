@@ -0,0 +1,152 @@
+// Kernel microbenchmarks.
+//
+// Each benchmark runs one hot kernel path in a loop inside a perf
+// region and reports the cost per iteration.  The 'bench' monitor
+// command runs them all; 'make flavor-report' runs it on every build
+// flavour to compare them.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/bench.h>
+#include <kern/perf.h>
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+
+static char bench_buf[PGSIZE] __attribute__((aligned(PGSIZE)));
+static char bench_buf2[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+bench_page_alloc(int iters)
+{
+	struct PageInfo *pp;
+
+	while (iters-- > 0) {
+		if (!(pp = page_alloc(0)))
+			panic("bench_page_alloc: out of memory");
+		page_free(pp);
+	}
+}
+
+static void
+bench_page_insert(int iters)
+{
+	struct PageInfo *pp;
+
+	if (!(pp = page_alloc(0)))
+		panic("bench_page_insert: out of memory");
+	// The extra mapping keeps the page and its page table alive
+	// across the loop's page_remove calls.
+	if (page_insert(kern_pgdir, pp, UTEMP + PGSIZE, PTE_W) < 0)
+		panic("bench_page_insert: out of memory");
+	while (iters-- > 0) {
+		if (page_insert(kern_pgdir, pp, UTEMP, PTE_W) < 0)
+			panic("bench_page_insert: out of memory");
+		page_remove(kern_pgdir, UTEMP);
+	}
+	page_remove(kern_pgdir, UTEMP + PGSIZE);
+}
+
+// Walks within one page table, which the ptcache answers.
+static void
+bench_pgdir_walk(int iters)
+{
+	int i;
+
+	for (i = 0; i < iters; i++)
+		pgdir_walk(kern_pgdir, (void *) (KERNBASE + (i & 1023) * PGSIZE), 0);
+}
+
+// Walks that alternate between two page tables whose PDXs are
+// PTCACHE_SIZE apart, so they evict each other from the ptcache and
+// every walk decodes the PDE: the kernel stacks' table and one near the
+// top of the KERNBASE map.
+static void
+bench_pgdir_walk_miss(int iters)
+{
+	uintptr_t va[2];
+	int i;
+
+	va[0] = KSTACKTOP - PTSIZE;
+	va[1] = va[0] + PTCACHE_SIZE * PTSIZE;
+	for (i = 0; i < iters; i++)
+		pgdir_walk(kern_pgdir, (void *) (va[i & 1] + ((i >> 1) & 1023) * PGSIZE), 0);
+}
+
+static void
+bench_kmalloc(int iters)
+{
+	void *p;
+
+	while (iters-- > 0) {
+		if (!(p = kmalloc(64)))
+			panic("bench_kmalloc: out of memory");
+		kfree(p);
+	}
+}
+
+static void
+bench_memset(int iters)
+{
+	while (iters-- > 0)
+		memset(bench_buf, iters, PGSIZE);
+}
+
+static void
+bench_memmove(int iters)
+{
+	while (iters-- > 0)
+		memmove(bench_buf2, bench_buf, PGSIZE);
+}
+
+static void
+bench_snprintf(int iters)
+{
+	while (iters-- > 0)
+		snprintf(bench_buf, 64, "%s %d %08x", "bench", iters, iters);
+}
+
+static struct {
+	struct PerfRegion region;
+	int iters;
+	void (*fn)(int iters);
+} benches[] = {
+	{ { "page_alloc" }, 10000, bench_page_alloc },
+	{ { "page_insert" }, 10000, bench_page_insert },
+	{ { "pgdir_walk" }, 100000, bench_pgdir_walk },
+	{ { "pgdir_walk_miss" }, 100000, bench_pgdir_walk_miss },
+	{ { "kmalloc" }, 100000, bench_kmalloc },
+	{ { "memset" }, 2000, bench_memset },
+	{ { "memmove" }, 2000, bench_memmove },
+	{ { "snprintf" }, 10000, bench_snprintf },
+};
+
+// Run every benchmark once and print, per iteration, the TSC ticks and
+// each event the PMU counts, one line per benchmark:
+//	bench: <name> <ticks> tsc/op[, <n> <event>/op ...]
+void
+bench_run(void)
+{
+	struct PerfRegion *r;
+	int i, e;
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		r = &benches[i].region;
+		r->count = 0;
+		r->tsc = 0;
+		memset(r->events, 0, sizeof(r->events));
+		perf_region_begin(r);
+		benches[i].fn(benches[i].iters);
+		perf_region_end(r);
+
+		cprintf("bench: %-16s %8llu tsc/op", r->name,
+			r->tsc / benches[i].iters);
+		for (e = 0; e < PERF_NEVENTS; e++)
+			if (perf_event_ok(e))
+				cprintf(", %llu %s/op",
+					r->events[e] / benches[i].iters,
+					perf_event_names[e]);
+		cprintf("\n");
+	}
+}
@@ -0,0 +1,9 @@
+#ifndef JOS_KERN_BENCH_H
+#define JOS_KERN_BENCH_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+void bench_run(void);
+
+#endif	// !JOS_KERN_BENCH_H
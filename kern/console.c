@@ -5,11 +5,16 @@
 #include <inc/kbdreg.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/trap.h>
 
 #include <kern/console.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
+static void cons_output(int c);
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -89,8 +94,8 @@ serial_init(void)
 	// 8 data bits, 1 stop bit, parity off; turn off DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_WLEN8 & ~COM_LCR_DLAB);
 
-	// No modem controls
-	outb(COM1+COM_MCR, 0);
+	// No modem controls, but OUT2 gates the UART's interrupt line
+	outb(COM1+COM_MCR, COM_MCR_OUT2);
 	// Enable rcv interrupts
 	outb(COM1+COM_IER, COM_IER_RDI);
 
@@ -180,11 +185,11 @@ cga_putc(int c)
 		crt_pos -= (crt_pos % CRT_COLS);
 		break;
 	case '\t':
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
+		cons_output(' ');
+		cons_output(' ');
+		cons_output(' ');
+		cons_output(' ');
+		cons_output(' ');
 		break;
 	default:
 		crt_buf[crt_pos++] = c;		/* write the character */
@@ -390,6 +395,27 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+// cons_in_lock protects the input devices and the input buffer;
+// cons_out_lock the output devices.  They are separate so that input
+// handling (e.g. kbd_proc_data) can print.
+static struct Spinlock cons_in_lock = SPINLOCK_INIT("console input");
+static struct Spinlock cons_out_lock = SPINLOCK_INIT("console output");
+
+// Take a console lock, unless the kernel has panicked.
+void
+cons_lock(struct Spinlock *lk)
+{
+	if (!panicstr)
+		spin_lock(lk);
+}
+
+void
+cons_unlock(struct Spinlock *lk)
+{
+	if (spin_holding(lk))
+		spin_unlock(lk);
+}
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
@@ -397,6 +423,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	cons_lock(&cons_in_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -404,6 +431,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	cons_unlock(&cons_in_lock);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -419,24 +447,36 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	cons_lock(&cons_in_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	cons_unlock(&cons_in_lock);
+	return c;
 }
 
-// output a character to the console
+// output a character to the console devices; the caller holds
+// cons_out_lock
 static void
-cons_putc(int c)
+cons_output(int c)
 {
 	serial_putc(c);
 	lpt_putc(c);
 	cga_putc(c);
 }
 
+// output a character to the console
+static void
+cons_putc(int c)
+{
+	cons_lock(&cons_out_lock);
+	cons_output(c);
+	cons_unlock(&cons_out_lock);
+}
+
 // initialize the console devices
 void
 cons_init(void)
@@ -445,7 +485,11 @@ cons_init(void)
 	kbd_init();
 	serial_init();
 
-	if (!serial_exists)
+	// Input arrives by interrupt; getchar sleeps until it does.
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_KBD));
+	if (serial_exists)
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_SERIAL));
+	else
 		cprintf("Serial port does not exist!\n");
 }
 
@@ -458,13 +502,42 @@ cputchar(int c)
 	cons_putc(c);
 }
 
+void
+cputs(const char *s, size_t len)
+{
+	cons_lock(&cons_out_lock);
+	while (len-- > 0)
+		cons_output(*s++);
+	cons_unlock(&cons_out_lock);
+}
+
+// Halt until an interrupt comes in, unless input already has.  The
+// check runs with interrupts off so that a keystroke arriving after it
+// still wakes the hlt.
+static void
+cons_wait(void)
+{
+	uint32_t eflags = read_eflags();
+
+	// After a panic, don't let interrupts in; just poll.
+	if (panicstr)
+		return;
+	cli();
+	if (cons.rpos == cons.wpos)
+		sti_hlt();
+	write_eflags(eflags);
+}
+
 int
 getchar(void)
 {
 	int c;
 
+	// Finish initializing pages[] while nobody is typing, then sleep
+	// until the keyboard or serial interrupt fills cons.buf.
 	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+		if (!page_init_idle())
+			cons_wait();
 	return c;
 }
 
@@ -23,4 +23,12 @@ int cons_getc(void);
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
 
+// Set by the first panic.  From then on cons_lock doesn't lock, since
+// the panicking CPU may hold the console locks already.
+extern const char *panicstr;
+
+struct Spinlock;
+void cons_lock(struct Spinlock *lk);
+void cons_unlock(struct Spinlock *lk);
+
 #endif /* _CONSOLE_H_ */
@@ -0,0 +1,64 @@
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+
+// Maximum number of CPUs
+#define NCPU  8
+
+// Values of status in struct CpuInfo
+enum {
+	CPU_UNUSED = 0,
+	CPU_STARTED,
+	CPU_HALTED,
+};
+
+// Per-CPU state
+struct CpuInfo {
+	struct CpuInfo *cpu_self;	// This struct, for thiscpu; must be first
+	uint8_t cpu_id;			// Local APIC ID; index into cpus[] below
+	volatile unsigned cpu_status;	// The status of the CPU
+	struct Taskstate cpu_ts;	// Used by x86 to find stack for interrupt
+	int cpu_ncli;			// Depth of push_cli nesting
+	int cpu_intena;			// Were interrupts on before push_cli?
+};
+
+// Each CPU's %fs selects a data segment whose base is its CpuInfo:
+// CPU i uses GD_CPU0 + (i << 3), right after the NCPU task segments.
+#define GD_CPU0		(GD_TSS0 + (NCPU << 3))
+
+// Initialized in mpconfig.c
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;                    // Total number of CPUs in the system
+extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
+
+// Per-CPU kernel stacks
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+// The running CPU's CpuInfo.  Valid once trap_init_percpu has loaded
+// this CPU's %fs.
+static inline struct CpuInfo *
+this_cpu(void)
+{
+	struct CpuInfo *c;
+
+	asm("movl %%fs:0,%0" : "=r" (c));
+	return c;
+}
+
+#define thiscpu		(this_cpu())
+#define cpunum()	(thiscpu - cpus)
+
+void	mp_init(void);
+void	lapic_init(void);
+void	lapic_startap(uint8_t apicid, uint32_t addr);
+void	lapic_eoi(void);
+struct CpuInfo *cpu_lookup(void);
+
+#endif	// !JOS_KERN_CPU_H
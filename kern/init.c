@@ -3,11 +3,20 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/trap.h>
+#include <kern/picirq.h>
+#include <kern/perf.h>
+#include <kern/region.h>
+#include <kern/kmem.h>
+#include <kern/cpu.h>
+
+static void boot_aps(void);
 
 
 void
@@ -20,6 +29,11 @@ i386_init(void)
 	// This ensures that all static/global variables start out zero.
 	memset(edata, 0, end - edata);
 
+	// Load our GDT and this CPU's %fs, which locks (even the
+	// console's) need for thiscpu.  trap_init does it again once the
+	// IDT is filled in.
+	trap_init_percpu();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -28,12 +42,94 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	kmem_init();
+
+	// Interrupt and exception handling; device IRQs stay masked
+	// until a driver (the console, the profiler) asks for them.
+	trap_init();
+
+	// Multiprocessor initialization functions
+	mp_init();
+	lapic_init();
+
+	pic_init();
+
+	// Demand-zero regions; needs the page fault handler.
+	region_init();
+
+	perf_init();
+
+	// Starting non-boot CPUs
+	boot_aps();
 
 	// Drop into the kernel monitor.
 	while (1)
 		monitor(NULL);
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+// How long boot_aps waits for an AP to report in, in polls.
+#define AP_START_SPINS	100000000
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct CpuInfo *c;
+	int n;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == cpus + cpunum())  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use
+		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_id, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		for (n = 0; c->cpu_status != CPU_STARTED && n < AP_START_SPINS; n++)
+			pause();
+		if (c->cpu_status != CPU_STARTED)
+			cprintf("SMP: CPU %d did not start\n", c->cpu_id);
+	}
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	uint32_t cr0;
+
+	// We are in high EIP now, safe to switch to kern_pgdir
+	lcr3(PADDR(kern_pgdir));
+	// The same cr0 flags mem_init sets on the boot CPU.
+	cr0 = rcr0();
+	cr0 |= CR0_PE|CR0_PG|CR0_AM|CR0_WP|CR0_NE|CR0_MP;
+	cr0 &= ~(CR0_TS|CR0_EM);
+	lcr0(cr0);
+
+	lapic_init();
+	trap_init_percpu();
+	cprintf("SMP: CPU %d starting\n", cpunum());
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// There is no scheduler to give this CPU work yet, so park it
+	// with interrupts off.
+	for (;;)
+		asm volatile("cli; hlt");
+}
+
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
@@ -55,7 +151,8 @@ _panic(const char *file, int line, const char *fmt,...)
 	panicstr = fmt;
 
 	// Be extra sure that the machine is in as reasonable state
-	asm volatile("cli; cld");
+	cli();
+	asm volatile("cld");
 
 	va_start(ap, fmt);
 	cprintf("kernel panic at %s:%d: ", file, line);
@@ -0,0 +1,117 @@
+// Interrupts-off latency tracer.
+//
+// Each CPU notes when and where interrupts went off, and when they
+// come back on, keeps the longest such section with the backtraces of
+// both ends.  Sections are opened and closed by the cli, sti and
+// write_eflags wrappers in inc/x86.h, and by trap() for the time an
+// interrupt gate holds interrupts off.  The kernel boots with
+// interrupts off and no section open, so the first sti closes nothing.
+//
+// The tracer itself must not go through those wrappers, or take locks.
+
+#include <inc/string.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/kdebug.h>
+#include <kern/irqsoff.h>
+
+#ifdef IRQSOFF_TRACE
+
+struct IrqsoffSection {
+	uint64_t tsc;			// Length, in TSC ticks
+	int noff;
+	uintptr_t off[IRQSOFF_DEPTH];	// Where interrupts went off
+	int non;
+	uintptr_t on[IRQSOFF_DEPTH];	// Where they came back on
+};
+
+static struct {
+	uint64_t start;			// When interrupts went off, or 0
+	int noff;
+	uintptr_t off[IRQSOFF_DEPTH];	// Where they went off
+	uint64_t nsections;		// Sections closed
+	uint64_t total;			// Their total length
+	struct IrqsoffSection max;	// The longest
+} irqsoff[NCPU];
+
+// Interrupts just went off on this CPU.
+void
+irqsoff_begin(void)
+{
+	int cpu = cpunum();
+
+	irqsoff[cpu].start = read_tsc();
+	irqsoff[cpu].noff = backtrace_capture(irqsoff[cpu].off, IRQSOFF_DEPTH);
+}
+
+// Interrupts are about to come back on on this CPU.
+void
+irqsoff_end(void)
+{
+	uint64_t now = read_tsc(), len;
+	int cpu = cpunum();
+
+	if (!irqsoff[cpu].start)
+		return;
+	len = now - irqsoff[cpu].start;
+	irqsoff[cpu].start = 0;
+	irqsoff[cpu].nsections++;
+	irqsoff[cpu].total += len;
+	if (len > irqsoff[cpu].max.tsc) {
+		irqsoff[cpu].max.tsc = len;
+		irqsoff[cpu].max.noff = irqsoff[cpu].noff;
+		memmove(irqsoff[cpu].max.off, irqsoff[cpu].off,
+			sizeof(irqsoff[cpu].off));
+		irqsoff[cpu].max.non = backtrace_capture(irqsoff[cpu].max.on,
+							 IRQSOFF_DEPTH);
+	}
+}
+
+// Print each CPU's longest interrupts-off section.
+void
+irqsoff_report(void)
+{
+	struct IrqsoffSection max;
+	uint64_t n, total;
+	uint32_t eflags;
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		// Copy first: printing may open and close sections.
+		eflags = read_eflags();
+		asm volatile("cli");
+		max = irqsoff[i].max;
+		n = irqsoff[i].nsections;
+		total = irqsoff[i].total;
+		if (eflags & FL_IF)
+			asm volatile("sti");
+		if (n == 0)
+			continue;
+
+		cprintf("irqsoff: CPU %d: %llu sections, %llu tsc average, "
+			"%llu tsc longest\n", i, n, total / n, max.tsc);
+		cprintf(" interrupts off at:\n");
+		backtrace_print(max.off, max.noff);
+		cprintf(" back on at:\n");
+		backtrace_print(max.on, max.non);
+	}
+}
+
+// Forget the sections seen so far.  A section open now still counts.
+void
+irqsoff_reset(void)
+{
+	uint32_t eflags = read_eflags();
+	int i;
+
+	asm volatile("cli");
+	for (i = 0; i < NCPU; i++) {
+		irqsoff[i].nsections = irqsoff[i].total = 0;
+		memset(&irqsoff[i].max, 0, sizeof(irqsoff[i].max));
+	}
+	if (eflags & FL_IF)
+		asm volatile("sti");
+}
+#endif
@@ -0,0 +1,17 @@
+#ifndef JOS_KERN_IRQSOFF_H
+#define JOS_KERN_IRQSOFF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#ifdef IRQSOFF_TRACE
+// Interrupts-off latency tracer, enabled with 'make DEFS=-DIRQSOFF_TRACE'.
+// irqsoff_begin and irqsoff_end are declared in inc/x86.h, whose cli,
+// sti and write_eflags call them.
+#define IRQSOFF_DEPTH	6	// Return addresses kept per backtrace
+
+void	irqsoff_report(void);
+void	irqsoff_reset(void);
+#endif
+
+#endif	// !JOS_KERN_IRQSOFF_H
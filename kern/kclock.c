@@ -20,3 +20,13 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+// Program the 8253 timer to raise IRQ 0 'hz' times per second.
+// Whether the interrupt is delivered is up to the 8259A mask.
+void
+kclock_init(unsigned hz)
+{
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
+	outb(IO_TIMER1, TIMER_DIV(hz) % 256);
+	outb(IO_TIMER1, TIMER_DIV(hz) / 256);
+}
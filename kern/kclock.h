@@ -23,7 +23,18 @@
 #define NVRAM_EXT16LO	(MC_NVRAM_START + 38)	/* low byte; RTC off. 0x34 */
 #define NVRAM_EXT16HI	(MC_NVRAM_START + 39)	/* high byte; RTC off. 0x35 */
 
+/* 8253/8254 programmable interval timer, channel 0 wired to IRQ 0 */
+#define	TIMER_FREQ	1193182
+#define	TIMER_DIV(x)	((TIMER_FREQ+(x)/2)/(x))
+
+#define	IO_TIMER1	0x040		/* 8253 Timer #1 */
+#define	TIMER_MODE	(IO_TIMER1 + 3)	/* timer mode port */
+#define	TIMER_SEL0	0x00		/* select counter 0 */
+#define	TIMER_RATEGEN	0x04		/* mode 2, rate generator */
+#define	TIMER_16BIT	0x30		/* r/w counter 16 bits, LSB first */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+void kclock_init(unsigned hz);
 
 #endif	// !JOS_KERN_KCLOCK_H
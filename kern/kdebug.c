@@ -2,8 +2,11 @@
 #include <inc/string.h>
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
 
 extern const struct Stab __STAB_BEGIN__[];	// Beginning of stabs table
 extern const struct Stab __STAB_END__[];	// End of stabs table
@@ -209,3 +212,139 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 
 	return 0;
 }
+
+
+// ksym_lookup(addr, info)
+//
+//	Like debuginfo_eip, but answers from the sorted table generated by
+//	kern/mksymtab.pl with a single binary search, instead of walking the
+//	STABS.  Fills in the function name and address, and the file and
+//	line when the table has them; eip_fn_narg is always 0.  Returns 0 if
+//	'addr' lies within a known kernel function, negative if not.
+//
+int
+ksym_lookup(uintptr_t addr, struct Eipdebuginfo *info)
+{
+	const struct Ksym *ks;
+	int l, r, m;
+
+	// Initialize *info
+	info->eip_file = "<unknown>";
+	info->eip_line = 0;
+	info->eip_fn_name = "<unknown>";
+	info->eip_fn_namelen = 9;
+	info->eip_fn_addr = addr;
+	info->eip_fn_narg = 0;
+
+	if (nksyms == 0 || addr < ksyms[0].ks_addr)
+		return -1;
+
+	// Find the last entry with ks_addr <= addr.
+	l = 0;
+	r = nksyms - 1;
+	while (l < r) {
+		m = (l + r + 1) / 2;
+		if (ksyms[m].ks_addr <= addr)
+			l = m;
+		else
+			r = m - 1;
+	}
+	ks = &ksyms[l];
+
+	// The entry at etext (and any other gap) has no function name.
+	if (ksymstr[ks->ks_name] == '\0')
+		return -1;
+
+	info->eip_fn_name = ksymstr + ks->ks_name;
+	info->eip_fn_namelen = strlen(info->eip_fn_name);
+	info->eip_fn_addr = ks->ks_fn_addr;
+	if (ksymstr[ks->ks_file] != '\0')
+		info->eip_file = ksymstr + ks->ks_file;
+	info->eip_line = ks->ks_line;
+	return 0;
+}
+
+
+// The running CPU's kernel stack [*lo, *hi): the boot CPU (always
+// cpus[0]) runs on bootstack, the others on their percpu_kstacks.
+static void
+kstack_bounds(uint32_t *lo, uint32_t *hi)
+{
+	int i = cpunum();
+
+	if (i == 0) {
+		*lo = (uint32_t) bootstack;
+		*hi = (uint32_t) bootstacktop;
+	} else {
+		*lo = (uint32_t) percpu_kstacks[i];
+		*hi = *lo + KSTKSIZE;
+	}
+}
+
+// backtrace_capture_ebp(ebp, pcs, max)
+//
+//	Store up to 'max' return addresses into 'pcs', following the chain
+//	of saved frame pointers that starts at 'ebp'.  Nothing is symbolized,
+//	so this is cheap enough for allocation and profiling paths.  The walk
+//	stops at the first frame that lies outside this CPU's kernel stack
+//	(see kstack_bounds), is misaligned, or does not move towards the
+//	stack top, so a corrupted chain can't fault or loop.
+//	Returns the number of addresses stored.
+//
+int
+backtrace_capture_ebp(uint32_t ebp, uintptr_t *pcs, int max)
+{
+	const uint32_t *frame;
+	uint32_t lo, hi;
+	int n = 0;
+
+	kstack_bounds(&lo, &hi);
+	while (n < max) {
+		if (ebp < lo || ebp > hi - 2 * sizeof(uint32_t) || (ebp & 3) != 0)
+			break;
+		frame = (const uint32_t *) ebp;
+		pcs[n++] = frame[1];
+		if (frame[0] <= ebp)
+			break;
+		ebp = frame[0];
+	}
+	return n;
+}
+
+// backtrace_capture(pcs, max)
+//
+//	Like backtrace_capture_ebp, starting from the caller's frame:
+//	pcs[0] is the return address of the function that called
+//	backtrace_capture.
+//
+int
+backtrace_capture(uintptr_t *pcs, int max)
+{
+	uint32_t ebp = read_ebp(), lo, hi;
+
+	// Skip our own frame.
+	kstack_bounds(&lo, &hi);
+	if (ebp < lo || ebp >= hi)
+		return 0;
+	return backtrace_capture_ebp(((uint32_t *) ebp)[0], pcs, max);
+}
+
+// backtrace_print(pcs, n)
+//
+//	Symbolize and print a stack captured earlier by backtrace_capture.
+//
+void
+backtrace_print(const uintptr_t *pcs, int n)
+{
+	struct Eipdebuginfo info;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		// A return address follows the call; look up the call itself.
+		if (ksym_lookup(pcs[i] - 1, &info) < 0)
+			debuginfo_eip(pcs[i] - 1, &info);
+		cprintf("  %08x %s:%d: %.*s+%d\n", pcs[i], info.eip_file,
+			info.eip_line, info.eip_fn_namelen, info.eip_fn_name,
+			pcs[i] - info.eip_fn_addr);
+	}
+}
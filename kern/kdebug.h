@@ -17,4 +17,24 @@ struct Eipdebuginfo {
 
 int debuginfo_eip(uintptr_t eip, struct Eipdebuginfo *info);
 
+// One entry of the sorted kernel symbol table generated at link time by
+// kern/mksymtab.pl.  An entry covers [ks_addr, next entry's ks_addr).
+struct Ksym {
+	uintptr_t ks_addr;		// First address covered by this entry
+	uintptr_t ks_fn_addr;		// Start of the enclosing function
+	uint32_t ks_name;		// Function name (offset into ksymstr)
+	uint32_t ks_file;		// Source file name (offset into ksymstr)
+	uint32_t ks_line;		// Source line number, or 0 if unknown
+};
+
+extern const struct Ksym ksyms[];
+extern const int nksyms;
+extern const char ksymstr[];
+
+int ksym_lookup(uintptr_t eip, struct Eipdebuginfo *info);
+
+int backtrace_capture(uintptr_t *pcs, int max);
+int backtrace_capture_ebp(uint32_t ebp, uintptr_t *pcs, int max);
+void backtrace_print(const uintptr_t *pcs, int n);
+
 #endif
@@ -0,0 +1,305 @@
+// Slab allocator for small kernel objects.
+//
+// Each cache hands out objects of one size from slabs.  A slab is one
+// page from page_alloc: a struct KmemSlab header, then as many objects
+// as fit.  Free objects in a slab are chained through their first
+// word, so allocation and freeing are O(1), and the slab of any object
+// is found by rounding its address down to the page.
+//
+// kmalloc and kfree use a set of caches with power-of-two sizes from
+// KMALLOC_MIN to KMALLOC_MAX.
+
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+
+struct KmemSlab {
+	struct KmemCache *ks_cache;	// Cache the slab belongs to
+	void *ks_free;			// First free object
+	int ks_inuse;			// Objects allocated from this slab
+	struct KmemSlab *ks_next;	// Next slab on the same list
+	struct KmemSlab *ks_prev;	// Previous slab on the same list
+};
+
+// The cache that struct KmemCaches themselves come from.
+static struct KmemCache cache_cache;
+static struct KmemCache *caches;	// All caches, for kmem_report
+
+#define NKMALLOC	8		// log2(KMALLOC_MAX / KMALLOC_MIN) + 1
+static struct KmemCache *kmalloc_caches[NKMALLOC];
+static const char * const kmalloc_names[NKMALLOC] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+static void check_kmem(void);
+
+static void
+slab_push(struct KmemSlab **list, struct KmemSlab *s)
+{
+	s->ks_prev = NULL;
+	s->ks_next = *list;
+	if (*list)
+		(*list)->ks_prev = s;
+	*list = s;
+}
+
+static void
+slab_unlink(struct KmemSlab **list, struct KmemSlab *s)
+{
+	if (s->ks_prev)
+		s->ks_prev->ks_next = s->ks_next;
+	else
+		*list = s->ks_next;
+	if (s->ks_next)
+		s->ks_next->ks_prev = s->ks_prev;
+}
+
+// Fill in 'kc' for objects of 'size' bytes aligned to 'align' and put
+// it on the list of caches.
+static int
+cache_setup(struct KmemCache *kc, const char *name, size_t size, size_t align)
+{
+	if (align == 0)
+		align = sizeof(void *);
+	if (align & (align - 1))
+		return -1;
+	memset(kc, 0, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_objsize = ROUNDUP(MAX(size, sizeof(void *)), align);
+	kc->kc_offset = ROUNDUP(sizeof(struct KmemSlab), align);
+	if (kc->kc_offset + kc->kc_objsize > PGSIZE)
+		return -1;
+	kc->kc_perslab = (PGSIZE - kc->kc_offset) / kc->kc_objsize;
+	kc->kc_link = caches;
+	caches = kc;
+	return 0;
+}
+
+void
+kmem_init(void)
+{
+	int i;
+
+	cache_setup(&cache_cache, "kmem_cache", sizeof(struct KmemCache), 0);
+	for (i = 0; i < NKMALLOC; i++)
+		assert((kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+							      KMALLOC_MIN << i, 0)));
+
+	check_kmem();
+}
+
+//
+// Create a cache of objects of 'size' bytes, aligned to 'align' (a
+// power of 2, or 0 for pointer alignment).  Returns NULL if there is
+// no memory, or if the alignment is invalid or an object doesn't fit
+// in a slab.
+//
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, size_t align)
+{
+	struct KmemCache *kc;
+
+	if (!(kc = kmem_cache_alloc(&cache_cache)))
+		return NULL;
+	if (cache_setup(kc, name, size, align) < 0) {
+		kmem_cache_free(&cache_cache, kc);
+		return NULL;
+	}
+	return kc;
+}
+
+// Free a slab's page.
+static void
+slab_release(struct KmemSlab *s)
+{
+	struct PageInfo *pp = pa2page(PADDR(s));
+
+	s->ks_cache->kc_nslabs--;
+	page_free(pp);
+}
+
+//
+// Destroy a cache, which must have no objects allocated.
+//
+void
+kmem_cache_destroy(struct KmemCache *kc)
+{
+	struct KmemCache **kcp;
+
+	if (kc->kc_nactive)
+		panic("kmem_cache_destroy: %s has %u active objects",
+		      kc->kc_name, kc->kc_nactive);
+	if (kc->kc_empty)
+		slab_release(kc->kc_empty);
+	for (kcp = &caches; *kcp != kc; kcp = &(*kcp)->kc_link)
+		assert(*kcp);
+	*kcp = kc->kc_link;
+	kmem_cache_free(&cache_cache, kc);
+}
+
+// Get a new slab for 'kc' from page_alloc.
+static struct KmemSlab *
+slab_grow(struct KmemCache *kc)
+{
+	struct PageInfo *pp;
+	struct KmemSlab *s;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	pp->pp_owner = PAGE_SLAB;
+	s = page2kva(pp);
+	s->ks_cache = kc;
+	s->ks_inuse = 0;
+	s->ks_free = NULL;
+	obj = (char *) s + kc->kc_offset + (kc->kc_perslab - 1) * kc->kc_objsize;
+	for (i = 0; i < kc->kc_perslab; i++, obj -= kc->kc_objsize) {
+		*(void **) obj = s->ks_free;
+		s->ks_free = obj;
+	}
+	kc->kc_nslabs++;
+	return s;
+}
+
+//
+// Allocate an object from 'kc'.  Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *kc)
+{
+	struct KmemSlab *s;
+	void *obj;
+
+	if ((s = kc->kc_partial))
+		slab_unlink(&kc->kc_partial, s);
+	else if ((s = kc->kc_empty))
+		kc->kc_empty = NULL;
+	else if (!(s = slab_grow(kc))) {
+		kc->kc_nfails++;
+		return NULL;
+	}
+
+	obj = s->ks_free;
+	s->ks_free = *(void **) obj;
+	s->ks_inuse++;
+	slab_push(s->ks_free ? &kc->kc_partial : &kc->kc_full, s);
+
+	kc->kc_nactive++;
+	kc->kc_nallocs++;
+	return obj;
+}
+
+//
+// Return 'obj' to 'kc'.  A slab left with no objects becomes the
+// cache's spare; if there already is one, the slab's page is freed.
+//
+void
+kmem_cache_free(struct KmemCache *kc, void *obj)
+{
+	struct KmemSlab *s = ROUNDDOWN(obj, PGSIZE);
+
+	if (s->ks_cache != kc)
+		panic("kmem_cache_free: %p is not from %s", obj, kc->kc_name);
+	slab_unlink(s->ks_free ? &kc->kc_partial : &kc->kc_full, s);
+	*(void **) obj = s->ks_free;
+	s->ks_free = obj;
+	s->ks_inuse--;
+	kc->kc_nactive--;
+	kc->kc_nfrees++;
+
+	if (s->ks_inuse > 0)
+		slab_push(&kc->kc_partial, s);
+	else if (!kc->kc_empty)
+		kc->kc_empty = s;
+	else
+		slab_release(s);
+}
+
+//
+// Allocate 'size' bytes from the smallest kmalloc cache that fits.
+// Returns NULL if size is over KMALLOC_MAX or memory is short.
+//
+void *
+kmalloc(size_t size)
+{
+	int i;
+
+	for (i = 0; KMALLOC_MIN << i < size; i++)
+		if (KMALLOC_MIN << i >= KMALLOC_MAX)
+			return NULL;
+	return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+void
+kfree(void *obj)
+{
+	struct KmemSlab *s;
+
+	if (!obj)
+		return;
+	s = ROUNDDOWN(obj, PGSIZE);
+	kmem_cache_free(s->ks_cache, obj);
+}
+
+// Print the statistics of every cache.
+void
+kmem_report(void)
+{
+	struct KmemCache *kc;
+
+	cprintf("cache           objsize perslab  slabs  active    allocs     frees  fails\n");
+	for (kc = caches; kc; kc = kc->kc_link)
+		cprintf("%-16s %6u %7d %6u %7u %9u %9u %6u\n", kc->kc_name,
+			kc->kc_objsize, kc->kc_perslab, kc->kc_nslabs,
+			kc->kc_nactive, kc->kc_nallocs, kc->kc_nfrees,
+			kc->kc_nfails);
+}
+
+static void
+check_kmem(void)
+{
+	static void *objs[600];
+	struct KmemCache *kc;
+	char *p;
+	int i, j;
+
+	// objects are distinct, aligned and reused after free
+	assert((kc = kmem_cache_create("check", 24, 8)));
+	assert(kc->kc_objsize == 24 && kc->kc_perslab > 100);
+	for (i = 0; i < 600; i++) {
+		assert((objs[i] = kmem_cache_alloc(kc)));
+		assert((uintptr_t) objs[i] % 8 == 0);
+		memset(objs[i], i, 24);
+	}
+	assert(kc->kc_nslabs == ROUNDUP(600, kc->kc_perslab) / kc->kc_perslab);
+	for (i = 0; i < 600; i++)
+		for (j = 0; j < 24; j++)
+			assert(((char *) objs[i])[j] == (char) i);
+	kmem_cache_free(kc, objs[1]);
+	assert(kmem_cache_alloc(kc) == objs[1]);
+
+	// freeing everything keeps one spare slab
+	for (i = 0; i < 600; i++)
+		kmem_cache_free(kc, objs[i]);
+	assert(kc->kc_nactive == 0 && kc->kc_nslabs == 1);
+	kmem_cache_destroy(kc);
+
+	// kmalloc picks the smallest class that fits
+	assert((p = kmalloc(1)));
+	assert(((struct KmemSlab *) ROUNDDOWN(p, PGSIZE))->ks_cache->kc_objsize == KMALLOC_MIN);
+	kfree(p);
+	assert((p = kmalloc(KMALLOC_MIN + 1)));
+	assert(((struct KmemSlab *) ROUNDDOWN(p, PGSIZE))->ks_cache->kc_objsize == 2 * KMALLOC_MIN);
+	kfree(p);
+	assert((p = kmalloc(KMALLOC_MAX)));
+	kfree(p);
+	assert(!kmalloc(KMALLOC_MAX + 1));
+	kfree(NULL);
+
+	CPRINTF_CACHED("check_kmem() succeeded!\n");
+}
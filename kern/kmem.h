@@ -0,0 +1,44 @@
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define KMALLOC_MIN	16	// Smallest kmalloc size class (power of 2)
+#define KMALLOC_MAX	2048	// Largest kmalloc size class (power of 2)
+
+struct KmemSlab;
+
+// A cache of equally sized objects.  Objects are carved out of slabs,
+// each one page from page_alloc with a small header at the front.
+struct KmemCache {
+	const char *kc_name;
+	size_t kc_objsize;		// Object size, rounded up for alignment
+	size_t kc_offset;		// Offset of the first object in a slab
+	int kc_perslab;			// Objects per slab
+	struct KmemSlab *kc_partial;	// Slabs with free and used objects
+	struct KmemSlab *kc_full;	// Slabs with no free objects
+	struct KmemSlab *kc_empty;	// A spare slab with no used objects
+
+	// Statistics
+	uint32_t kc_nslabs;		// Slabs (pages) held now
+	uint32_t kc_nactive;		// Objects allocated now
+	uint32_t kc_nallocs;		// Successful kmem_cache_alloc calls
+	uint32_t kc_nfrees;		// kmem_cache_free calls
+	uint32_t kc_nfails;		// Allocations that found no memory
+
+	struct KmemCache *kc_link;	// Next on the list of all caches
+};
+
+void	kmem_init(void);
+struct KmemCache *kmem_cache_create(const char *name, size_t size, size_t align);
+void	kmem_cache_destroy(struct KmemCache *kc);
+void	*kmem_cache_alloc(struct KmemCache *kc);
+void	kmem_cache_free(struct KmemCache *kc, void *obj);
+void	*kmalloc(size_t size);
+void	kfree(void *obj);
+void	kmem_report(void);
+
+#endif	// !JOS_KERN_KMEM_H
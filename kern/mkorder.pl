@@ -0,0 +1,41 @@
+#!/usr/bin/perl
+#
+# Usage: perl kern/mkorder.pl kern/kernel.ld < order > kernel.ld
+#
+# Emits a copy of the kernel linker script that places the functions
+# named in the order file, in order, at the start of .text, right after
+# entry.S.  The kernel must be compiled with -ffunction-sections so each
+# function has its own .text.<name> section to place.
+#
+# The order file lists one function per line; '#' starts a comment.
+# The output of the kernel monitor's 'prof' command works as well: the
+# function is taken from each "samples % function" row, so a console log
+# of a profiling run gives the order directly.  Other lines are ignored.
+
+my (@order, %seen);
+
+while (<STDIN>) {
+	s/#.*//;
+	my $fn;
+	if (/^\s*\d+\s+\d+\s+([A-Za-z_]\w*)\s*$/) {
+		$fn = $1;
+	} elsif (/^\s*([A-Za-z_]\w*)\s*$/) {
+		$fn = $1;
+	}
+	push @order, $fn if defined($fn) && !$seen{$fn}++;
+}
+
+open(LD, $ARGV[0]) || die "open $ARGV[0]: $!";
+my $done = 0;
+while (<LD>) {
+	if (!$done && /^(\s*)\*\(\.text /) {
+		my $indent = $1;
+		print "$indent*/kern/entry.o(.text)\n";
+		print "$indent/* Hot functions, from the order file */\n";
+		print "$indent*(.text.$_)\n" foreach @order;
+		$done = 1;
+	}
+	print;
+}
+close LD;
+die "$ARGV[0]: no .text input section to order" unless $done;
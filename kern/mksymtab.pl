@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+#
+# Usage: (nm -n kernel; objdump -d -l kernel) | perl mksymtab.pl > ksymtab.c
+#
+# Builds the sorted address table used by ksym_lookup() in kern/kdebug.c.
+# Function start addresses come from the 'nm -n' lines of the input and
+# source line numbers from the 'objdump -l' annotations.  Each entry
+# covers the addresses up to the next entry, so one binary search finds
+# the function, file and line for any kernel text address.
+#
+# With no input, emits an empty table (used for the first kernel link).
+
+my %fn;		# address -> function name
+my %line;	# address -> [file, line]
+my ($text, $etext);
+my ($file, $lineno);
+
+while (<STDIN>) {
+	chomp;
+	if (/^([0-9a-f]{8}) [A-Za-z] etext$/) {
+		$etext = hex($1);
+	} elsif (/^([0-9a-f]{8}) [tTwW] (\S+)$/) {
+		$fn{hex($1)} = $2 unless exists $fn{hex($1)};
+	} elsif (/^(\S+):(\d+)(?: \(discriminator \d+\))?$/) {
+		($file, $lineno) = ($1, $2);
+	} elsif (/^\s*([0-9a-f]+):\t/) {
+		$text = hex($1) unless defined($text);
+		$line{hex($1)} = [$file, $lineno] if defined($file);
+		undef $file;
+	}
+}
+
+# Keep only addresses inside [.text, etext); the last function stops at etext.
+my @addrs = sort { $a <=> $b } keys %{{ %fn, %line }};
+@addrs = grep { $_ >= $text } @addrs if defined($text);
+@addrs = grep { $_ < $etext } @addrs if defined($etext);
+
+my $strtab = "";
+my %stroff;
+sub str {
+	my $s = shift;
+	if (!exists $stroff{$s}) {
+		$stroff{$s} = length($strtab);
+		$strtab .= $s . "\0";
+	}
+	return $stroff{$s};
+}
+str("");
+
+my @ents;
+my ($fnaddr, $fnname, $cur, $prev) = (0, "", ["", 0], "");
+foreach my $a (@addrs) {
+	if (exists $fn{$a}) {
+		($fnaddr, $fnname) = ($a, $fn{$a});
+		$cur = ["", 0];
+	}
+	$cur = $line{$a} if exists $line{$a};
+	my $key = "$fnaddr $cur->[0] $cur->[1]";
+	next if $key eq $prev;
+	$prev = $key;
+	push @ents, sprintf("\t{ 0x%08x, 0x%08x, %d, %d, %d },\n",
+			    $a, $fnaddr, str($fnname), str($cur->[0]), $cur->[1]);
+}
+push @ents, sprintf("\t{ 0x%08x, 0, 0, 0, 0 },\n", $etext) if defined($etext);
+
+print "// Generated by kern/mksymtab.pl.  DO NOT EDIT.\n\n";
+print "#include <kern/kdebug.h>\n\n";
+print "const struct Ksym ksyms[] = {\n", @ents, "};\n\n";
+print "const int nksyms = ", scalar(@ents), ";\n\n";
+print "const char ksymstr[] =\n";
+foreach my $s (split(/\0/, $strtab)) {
+	$s =~ s/([\\"])/\\$1/g;
+	print "\t\"$s\\0\"\n";
+}
+print "\t\"\";\n";
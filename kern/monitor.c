@@ -11,6 +11,12 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/pmap.h>
+#include <kern/prof.h>
+#include <kern/perf.h>
+#include <kern/kmem.h>
+#include <kern/bench.h>
+#include <kern/spinlock.h>
+#include <kern/irqsoff.h>
 
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
@@ -29,19 +35,26 @@ static struct Command commands[] = {
   { "smps", "DIsplay information between vitual and physical memory", mon_showmappings},
   { "stp", "Set permissions of vitual address",mon_setpermissions},
   { "clr", "Clear permissions of vitual address",mon_clearpermissions},
+  { "prof", "Sampling profiler: prof start [hz] | stop | dump [n]", mon_prof },
+  { "perf", "Performance counters: perf [reset | <command> [args]]", mon_perf },
+  { "meminfo", "Display physical memory usage and fragmentation", mon_meminfo },
+  { "kmem", "Display slab cache statistics", mon_kmem },
+  { "bench", "Run the kernel microbenchmarks", mon_bench },
+#ifdef LOCK_STATS
+  { "locks", "Display lock contention statistics: locks [reset]", mon_locks },
+#endif
+#ifdef IRQSOFF_TRACE
+  { "irqsoff", "Display the longest interrupts-off sections: irqsoff [reset]", mon_irqsoff },
+#endif
+#ifdef PAGE_TRACK
+  { "pagesites", "Display the call sites holding the most pages: pagesites [n]", mon_pagesites },
+#endif
 };
 
 /***** Implementations of basic kernel monitor commands *****/
 
 #define IS_HEX(s) (s[0]=='0'&&s[1]=='x')
 
-#define PDE(pgdir,va) pgdir[PDX(va)]
-#define PTE_PT(pgdir,va) (pte_t *)(KADDR(PTE_ADDR(PDE(pgdir,va)))+PTX(va))
-#define PTE(pgdir,va) (*PTE_PT(pgdir,va))
-#define P_PDE(pgdir,va) PDE(pgdir,va)|PTE_P
-#define P_PTE(pgdir,va) PTE(pgdir,va)|PTE_P
-#define PERM(pgdir,va) PTE(pgdir,va)&0x1FF
-
 static inline void
 num2binstr(uint32_t perm, char *s, size_t num) {
   while(num--) {
@@ -125,12 +138,11 @@ change_permissions(int argc, char **argv, int flags, char *hint) {
   uintptr_t va;
   for(int cnt=0; cnt < n_pages; cnt++) {
       va = va_start + PGSIZE*cnt;
-      if(P_PDE(kern_pgdir,va)&&P_PTE(kern_pgdir,va)) {
-        pte = PTE_PT(kern_pgdir,va);
-        if(*pte&PTE_P) {
-          *pte = flags? *pte|perm : *pte^perm;
-          *pte |= PTE_P;
-        }
+      // pgdir_walk's cache makes consecutive pages in a table cheap.
+      pte = pgdir_walk(kern_pgdir, (void *)va, 0);
+      if(pte && (*pte&PTE_P)) {
+        *pte = flags? *pte|perm : *pte^perm;
+        *pte |= PTE_P;
       }
   }
 }
@@ -152,14 +164,16 @@ mon_showmappings(int argc, char **argv, struct Trapframe *tf) {
         "virtual_ad  physica_ad  GIDACTUWP\n");
   uintptr_t va;
   int cnt;
+  pte_t pte;
   extern pde_t *kern_pgdir;
   for(cnt = 0; cnt < n_pages; cnt++) {
     va = va_start + cnt*PGSIZE;
-    if(P_PDE(kern_pgdir,va) && P_PTE(kern_pgdir, va)) {
+    pte = pte_get(kern_pgdir, (void *)va);
+    if(pte & PTE_P) {
       char permission[10];
       permission[9] = '\0';
-      num2binstr(PERM(kern_pgdir, va), permission, 9);
-      cprintf("0x%08x  0x%08x  %s\n",va,PTE_ADDR(PTE(kern_pgdir,va)),permission);
+      num2binstr(pte & 0x1FF, permission, 9);
+      cprintf("0x%08x  0x%08x  %s\n",va,PTE_ADDR(pte),permission);
       continue;
     }
     cprintf("0x%08x  ----------  ---------\n",va);	
@@ -219,11 +233,11 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	extern char _start[], entry[], etext[], edata[], end[];
 
 	cprintf("Special kernel symbols:\n");
-	cprintf("  _start                  %08x (phys)\n", _start);
-	cprintf("  entry  %08x (virt)  %08x (phys)\n", entry, entry - KERNBASE);
-	cprintf("  etext  %08x (virt)  %08x (phys)\n", etext, etext - KERNBASE);
-	cprintf("  edata  %08x (virt)  %08x (phys)\n", edata, edata - KERNBASE);
-	cprintf("  end    %08x (virt)  %08x (phys)\n", end, end - KERNBASE);
+	cprintf("  _start                  %08x (phys)\n", (uintptr_t) _start);
+	cprintf("  entry  %08x (virt)  %08x (phys)\n", (uintptr_t) entry, (uintptr_t) entry - KERNBASE);
+	cprintf("  etext  %08x (virt)  %08x (phys)\n", (uintptr_t) etext, (uintptr_t) etext - KERNBASE);
+	cprintf("  edata  %08x (virt)  %08x (phys)\n", (uintptr_t) edata, (uintptr_t) edata - KERNBASE);
+	cprintf("  end    %08x (virt)  %08x (phys)\n", (uintptr_t) end, (uintptr_t) end - KERNBASE);
 	cprintf("Kernel executable memory footprint: %dKB\n",
 		ROUNDUP(end - entry, 1024) / 1024);
 	return 0;
@@ -237,8 +251,9 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
   struct Eipdebuginfo info;
   cprintf("Stack backtrace:\n");
   while(bp != NULL) {
-    cprintf("ebp %8x  eip %8x  args %08x %08x %08x %08x %08x\n", bp,  bp[1], bp[2], bp[3], bp[4], bp[5], bp[6]);
-    debuginfo_eip(bp[1], &info);
+    cprintf("ebp %8x  eip %8x  args %08x %08x %08x %08x %08x\n", (uint32_t) bp,  bp[1], bp[2], bp[3], bp[4], bp[5], bp[6]);
+    if (ksym_lookup(bp[1], &info) < 0)
+      debuginfo_eip(bp[1], &info);
     cprintf("\t%s:%d: %.*s+%d\n", info.eip_file, info.eip_line, info.eip_fn_namelen, info.eip_fn_name, bp[1] - info.eip_fn_addr);
     bp = (uint32_t *)(*bp);
   }
@@ -247,6 +262,120 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 }
 
 
+int
+mon_prof(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc >= 2 && strcmp(argv[1], "start") == 0) {
+		long hz = argc >= 3 ? strtol(argv[2], 0, 0) : PROF_HZ;
+		// The 8253 divisor is 16 bits wide.
+		if (hz < 19 || hz > 10000) {
+			cprintf("prof: rate must be 19..10000 Hz\n");
+			return 0;
+		}
+		if (prof_start(hz) < 0) {
+			cprintf("prof: no memory for the sample buffers\n");
+			return 0;
+		}
+		cprintf("prof: sampling at %ld Hz\n", hz);
+	} else if (argc >= 2 && strcmp(argv[1], "stop") == 0) {
+		prof_stop();
+	} else if (argc >= 2 && strcmp(argv[1], "dump") == 0) {
+		prof_report(argc >= 3 ? strtol(argv[2], 0, 0) : 10);
+		prof_dump_stacks();
+	} else
+		cprintf("usage: prof start [hz] | stop | dump [n]\n");
+	return 0;
+}
+
+// With no arguments, print the counter totals of every measured region.
+// Otherwise run the given monitor command as a region of its own and
+// print what it cost.
+int
+mon_perf(int argc, char **argv, struct Trapframe *tf)
+{
+	static struct PerfRegion cmd_regions[ARRAY_SIZE(commands)];
+	struct PerfRegion *r;
+	int i, ret;
+
+	if (argc == 1) {
+		perf_report();
+		return 0;
+	}
+	if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+		perf_reset();
+		return 0;
+	}
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		if (strcmp(argv[1], commands[i].name) == 0)
+			break;
+	if (i == ARRAY_SIZE(commands)) {
+		cprintf("Unknown command '%s'\n", argv[1]);
+		return 0;
+	}
+
+	r = &cmd_regions[i];
+	r->name = commands[i].name;
+	perf_region_begin(r);
+	ret = commands[i].func(argc - 1, argv + 1, tf);
+	perf_region_end(r);
+	perf_region_print(r);
+	return ret;
+}
+
+int
+mon_meminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	page_meminfo();
+	return 0;
+}
+
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_report();
+	return 0;
+}
+
+int
+mon_bench(int argc, char **argv, struct Trapframe *tf)
+{
+	bench_run();
+	return 0;
+}
+
+#ifdef LOCK_STATS
+int
+mon_locks(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc >= 2 && strcmp(argv[1], "reset") == 0)
+		lock_reset();
+	else
+		lock_report();
+	return 0;
+}
+#endif
+
+#ifdef IRQSOFF_TRACE
+int
+mon_irqsoff(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc >= 2 && strcmp(argv[1], "reset") == 0)
+		irqsoff_reset();
+	else
+		irqsoff_report();
+	return 0;
+}
+#endif
+
+#ifdef PAGE_TRACK
+int
+mon_pagesites(int argc, char **argv, struct Trapframe *tf)
+{
+	page_sites_report(argc >= 2 ? strtol(argv[1], 0, 0) : 10);
+	return 0;
+}
+#endif
+
 
 /***** Kernel monitor command interpreter *****/
 
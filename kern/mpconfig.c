@@ -0,0 +1,337 @@
+// Search for and parse the multiprocessor configuration table.
+//
+// mp_init prefers the ACPI Multiple APIC Description Table (MADT) and
+// falls back to the older Intel MultiProcessor Specification tables.
+// Both are found by scanning the BIOS areas of low memory for a
+// signature.  If neither is there, the kernel runs on one CPU.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+
+struct CpuInfo cpus[NCPU];
+struct CpuInfo *bootcpu;
+int ncpu;
+
+// Per-CPU kernel stacks
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+__attribute__ ((aligned(PGSIZE)));
+
+
+// See MultiProcessor Specification Version 1.[14]
+
+struct mp {             // floating pointer [MP 4.1]
+	uint8_t signature[4];           // "_MP_"
+	physaddr_t physaddr;            // phys addr of MP config table
+	uint8_t length;                 // 1
+	uint8_t specrev;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t type;                   // MP system config type
+	uint8_t imcrp;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct mpconf {         // configuration table header [MP 4.2]
+	uint8_t signature[4];           // "PCMP"
+	uint16_t length;                // total table length
+	uint8_t version;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t product[20];            // product id
+	physaddr_t oemtable;            // OEM table pointer
+	uint16_t oemlength;             // OEM table length
+	uint16_t entry;                 // entry count
+	physaddr_t lapicaddr;           // address of local APIC
+	uint16_t xlength;               // extended table length
+	uint8_t xchecksum;              // extended table checksum
+	uint8_t reserved;
+	uint8_t entries[0];             // table entries
+} __attribute__((__packed__));
+
+struct mpproc {         // processor table entry [MP 4.3.1]
+	uint8_t type;                   // entry type (0)
+	uint8_t apicid;                 // local APIC id
+	uint8_t version;                // local APIC version
+	uint8_t flags;                  // CPU flags
+	uint8_t signature[4];           // CPU signature
+	uint32_t feature;               // feature flags from CPUID instruction
+	uint8_t reserved[8];
+} __attribute__((__packed__));
+
+// mpproc flags
+#define MPPROC_ENABLED 0x01             // This processor is usable
+
+// Table entry types
+#define MPPROC    0x00  // One per processor
+#define MPBUS     0x01  // One per bus
+#define MPIOAPIC  0x02  // One per I/O APIC
+#define MPIOINTR  0x03  // One per bus interrupt source
+#define MPLINTR   0x04  // One per system interrupt source
+
+
+// See Advanced Configuration and Power Interface Specification 5.2
+
+struct rsdp {           // Root System Description Pointer [ACPI 5.2.5]
+	uint8_t signature[8];           // "RSD PTR "
+	uint8_t checksum;               // first 20 bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t revision;
+	physaddr_t rsdtaddr;            // phys addr of the RSDT
+} __attribute__((__packed__));
+
+struct sdthdr {         // system description table header [ACPI 5.2.6]
+	uint8_t signature[4];
+	uint32_t length;                // total table length, header included
+	uint8_t revision;
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t oemtableid[8];
+	uint32_t oemrevision;
+	uint32_t creatorid;
+	uint32_t creatorrevision;
+} __attribute__((__packed__));
+
+struct madt {           // Multiple APIC Description Table [ACPI 5.2.12]
+	struct sdthdr hdr;              // signature "APIC"
+	physaddr_t lapicaddr;           // address of local APIC
+	uint32_t flags;
+	uint8_t entries[0];             // interrupt controller structures
+} __attribute__((__packed__));
+
+struct madtlapic {      // processor local APIC structure [ACPI 5.2.12.2]
+	uint8_t type;                   // MADT_LAPIC
+	uint8_t length;                 // 8
+	uint8_t acpiid;                 // ACPI processor id
+	uint8_t apicid;                 // local APIC id
+	uint32_t flags;                 // MADT_ENABLED
+} __attribute__((__packed__));
+
+#define MADT_LAPIC   0x00               // Processor local APIC structure
+#define MADT_ENABLED 0x01               // This processor is usable
+
+
+static uint8_t
+sum(void *addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += ((uint8_t *)addr)[i];
+	return sum;
+}
+
+// Kernel address of the firmware table [pa, pa+len), or NULL if it is
+// outside the direct map.  Firmware tables often sit in reserved memory
+// past the last usable page, where KADDR would panic, but kern_pgdir
+// maps all of [KERNBASE, 4GB).
+static void *
+fwaddr(physaddr_t pa, uint32_t len)
+{
+	if (pa + len < pa || pa + len > DIRECTMAP_SIZE)
+		return NULL;
+	return (void *) (pa + KERNBASE);
+}
+
+// Look for a structure starting with the 'siglen' bytes of 'sig', whose
+// first 'sumlen' bytes add up to 0, on a 16-byte boundary in the 'len'
+// bytes at physical address a.
+static void *
+search1(physaddr_t a, int len, const char *sig, int siglen, int sumlen)
+{
+	uint8_t *p = fwaddr(a, len), *e = p + len;
+
+	for (; p && p + sumlen <= e; p += 16)
+		if (memcmp(p, sig, siglen) == 0 && sum(p, sumlen) == 0)
+			return p;
+	return NULL;
+}
+
+// Search in the order that the MP and ACPI specifications require:
+// 1) in the first KB of the EBDA;
+// 2) if there is no EBDA, in the last KB of system base memory;
+// 3) in the BIOS ROM between 0xE0000 and 0xFFFFF.
+static void *
+bios_search(const char *sig, int siglen, int sumlen)
+{
+	uint8_t *bda;
+	uint32_t p;
+	void *r;
+
+	bda = fwaddr(0x400, 0x100);
+	if ((p = *(uint16_t *) (bda + 0x0E))) {
+		p <<= 4;	// Translate from segment to PA
+		if ((r = search1(p, 1024, sig, siglen, sumlen)))
+			return r;
+	} else {
+		p = *(uint16_t *) (bda + 0x13) * 1024;
+		if ((r = search1(p - 1024, 1024, sig, siglen, sumlen)))
+			return r;
+	}
+	return search1(0xE0000, 0x20000, sig, siglen, sumlen);
+}
+
+static void
+cpu_add(uint8_t apicid)
+{
+	if (ncpu < NCPU) {
+		cpus[ncpu].cpu_id = apicid;
+		ncpu++;
+	} else
+		cprintf("SMP: too many CPUs, CPU %d disabled\n", apicid);
+}
+
+// Check the ACPI table at 'pa' and return it if its signature is 'sig'.
+static struct sdthdr *
+acpi_table(physaddr_t pa, const char *sig)
+{
+	struct sdthdr *h;
+
+	if (!(h = fwaddr(pa, sizeof(*h))) || memcmp(h->signature, sig, 4) != 0)
+		return NULL;
+	if (h->length < sizeof(*h) || !fwaddr(pa, h->length)
+	    || sum(h, h->length) != 0)
+		return NULL;
+	return h;
+}
+
+// Find the CPUs in the ACPI MADT.  Returns 0 if there is none.
+static bool
+acpi_init(void)
+{
+	struct rsdp *rsdp;
+	struct sdthdr *rsdt;
+	struct madt *madt = NULL;
+	struct madtlapic *proc;
+	physaddr_t *tables;
+	uint8_t *p, *e;
+	int i, n;
+
+	if (!(rsdp = bios_search("RSD PTR ", 8, 20)))
+		return 0;
+	if (!(rsdt = acpi_table(rsdp->rsdtaddr, "RSDT")))
+		return 0;
+	tables = (physaddr_t *) (rsdt + 1);
+	n = (rsdt->length - sizeof(*rsdt)) / sizeof(*tables);
+	for (i = 0; i < n && !madt; i++)
+		madt = (struct madt *) acpi_table(tables[i], "APIC");
+	if (!madt)
+		return 0;
+
+	lapicaddr = madt->lapicaddr;
+	e = (uint8_t *) madt + madt->hdr.length;
+	// Each structure starts with its type and length.
+	for (p = madt->entries; p + 2 <= e && p[1] >= 2 && p + p[1] <= e; p += p[1]) {
+		if (p[0] != MADT_LAPIC)
+			continue;
+		proc = (struct madtlapic *) p;
+		if (proc->flags & MADT_ENABLED)
+			cpu_add(proc->apicid);
+	}
+	return 1;
+}
+
+// Find the CPUs in the MP configuration table.  Returns 0 if there is
+// none or it is unusable.
+static bool
+mpconfig_init(void)
+{
+	struct mp *mp;
+	struct mpconf *conf;
+	struct mpproc *proc;
+	uint8_t *p;
+	int i;
+
+	if (!(mp = bios_search("_MP_", 4, sizeof(*mp))))
+		return 0;
+	if (mp->physaddr == 0 || mp->type != 0) {
+		cprintf("SMP: Default configurations not implemented\n");
+		return 0;
+	}
+	conf = fwaddr(mp->physaddr, sizeof(*conf));
+	if (!conf || memcmp(conf, "PCMP", 4) != 0) {
+		cprintf("SMP: Incorrect MP configuration table signature\n");
+		return 0;
+	}
+	if (!fwaddr(mp->physaddr, conf->length) || sum(conf, conf->length) != 0) {
+		cprintf("SMP: Bad MP configuration checksum\n");
+		return 0;
+	}
+	if (conf->version != 1 && conf->version != 4) {
+		cprintf("SMP: Unsupported MP version %d\n", conf->version);
+		return 0;
+	}
+	if ((sum((uint8_t *)conf + conf->length, conf->xlength) + conf->xchecksum) & 0xff) {
+		cprintf("SMP: Bad MP configuration extended checksum\n");
+		return 0;
+	}
+
+	lapicaddr = conf->lapicaddr;
+	for (p = conf->entries, i = 0; i < conf->entry; i++) {
+		switch (*p) {
+		case MPPROC:
+			proc = (struct mpproc *)p;
+			if (proc->flags & MPPROC_ENABLED)
+				cpu_add(proc->apicid);
+			p += sizeof(struct mpproc);
+			continue;
+		case MPBUS:
+		case MPIOAPIC:
+		case MPIOINTR:
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			cprintf("mpinit: unknown config type %x\n", *p);
+			ncpu = 0;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void
+mp_init(void)
+{
+	uint32_t ebx, bsp;
+	const char *from;
+	int i;
+
+	if (acpi_init())
+		from = "ACPI MADT";
+	else if (mpconfig_init())
+		from = "MP table";
+	else
+		from = NULL;
+
+	// The CPU running this is the BSP.  Put it in cpus[0], where
+	// trap_init_percpu has already set it up.
+	cpuid(1, NULL, &ebx, NULL, NULL);
+	bsp = ebx >> 24;
+	for (i = 0; i < ncpu && cpus[i].cpu_id != bsp; i++)
+		/* empty */;
+	if (!from || i == ncpu || lapicaddr == 0) {
+		// Didn't find the BSP; run on one CPU and leave the
+		// local APIC alone.
+		ncpu = 1;
+		cpus[0].cpu_id = bsp;
+		lapicaddr = 0;
+		from = NULL;
+	} else {
+		cpus[i].cpu_id = cpus[0].cpu_id;
+		cpus[0].cpu_id = bsp;
+	}
+	bootcpu = &cpus[0];
+	bootcpu->cpu_status = CPU_STARTED;
+
+	if (from)
+		cprintf("SMP: CPU %d found %d CPU(s) in the %s\n",
+			bootcpu->cpu_id, ncpu, from);
+	else
+		cprintf("SMP: no usable MP configuration, using one CPU\n");
+}
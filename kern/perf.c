@@ -0,0 +1,166 @@
+// Hardware performance counters.
+//
+// Programs the Intel architectural PMU (CPUID leaf 0xA) so that general
+// purpose counter i counts event i of the PERF_* list, in both kernel and
+// user mode, and reads the counters with RDPMC.  When the CPU reports no
+// PMU (QEMU's TCG, AMD, older CPUs) or fewer counters than events, the
+// missing events read as zero and only the TSC is measured.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/perf.h>
+
+#define MSR_PERFEVTSEL0		0x186	// + counter index
+#define MSR_PERF_GLOBAL_CTRL	0x38F	// PMU version 2 and later
+
+#define PERFEVTSEL_USR		(1 << 16)
+#define PERFEVTSEL_OS		(1 << 17)
+#define PERFEVTSEL_EN		(1 << 22)
+
+// Event select and unit mask for each PERF_* event.
+static const struct {
+	uint8_t event;
+	uint8_t umask;
+	int cpuid_bit;		// bit in CPUID.0AH:EBX that marks it absent,
+				// or -1 for a model-specific event
+} perf_events[PERF_NEVENTS] = {
+	[PERF_CYCLES]		= { 0x3C, 0x00, 0 },
+	[PERF_INSTRS]		= { 0xC0, 0x00, 1 },
+	[PERF_LLC_MISSES]	= { 0x2E, 0x41, 4 },
+	[PERF_DTLB_MISSES]	= { 0x08, 0x01, -1 },
+};
+
+const char * const perf_event_names[PERF_NEVENTS] = {
+	[PERF_CYCLES]		= "cycles",
+	[PERF_INSTRS]		= "instructions",
+	[PERF_LLC_MISSES]	= "llc-misses",
+	[PERF_DTLB_MISSES]	= "dtlb-misses",
+};
+
+static uint32_t perf_version;	// architectural PMU version, 0 if none
+static uint32_t perf_ok;	// bit i set if event i is being counted
+static uint64_t perf_mask;	// valid bits of a counter
+static struct PerfRegion *perf_regions;
+
+void
+perf_init(void)
+{
+	uint32_t eax, ebx, ecx, edx, ncounters, width, i;
+	char vendor[13];
+
+	cpuid(0, &eax, &ebx, &ecx, &edx);
+	memcpy(vendor, &ebx, 4);
+	memcpy(vendor + 4, &edx, 4);
+	memcpy(vendor + 8, &ecx, 4);
+	vendor[12] = '\0';
+	if (strcmp(vendor, "GenuineIntel") != 0 || eax < 0xA) {
+		cprintf("perf: no architectural PMU (%s)\n", vendor);
+		return;
+	}
+
+	cpuid(0xA, &eax, &ebx, 0, 0);
+	perf_version = eax & 0xFF;
+	ncounters = (eax >> 8) & 0xFF;
+	width = (eax >> 16) & 0xFF;
+	if (perf_version == 0 || ncounters == 0 || width == 0) {
+		cprintf("perf: no architectural PMU\n");
+		perf_version = 0;
+		return;
+	}
+	perf_mask = width >= 64 ? ~0ULL : (1ULL << width) - 1;
+
+	for (i = 0; i < PERF_NEVENTS && i < ncounters; i++) {
+		if (perf_events[i].cpuid_bit >= 0
+		    && (ebx & (1 << perf_events[i].cpuid_bit)))
+			continue;
+		wrmsr(MSR_PERFEVTSEL0 + i, 0);
+		wrmsr(MSR_PERFEVTSEL0 + i,
+		      perf_events[i].event | (perf_events[i].umask << 8)
+		      | PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+		perf_ok |= 1 << i;
+	}
+	if (perf_version >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, (1ULL << ncounters) - 1);
+
+	cprintf("perf: PMU v%u, %u counters of %u bits\n",
+		perf_version, ncounters, width);
+}
+
+bool
+perf_event_ok(int event)
+{
+	return (perf_ok >> event) & 1;
+}
+
+// Read the current value of every event counter.
+void
+perf_read(uint64_t counts[PERF_NEVENTS])
+{
+	int i;
+
+	for (i = 0; i < PERF_NEVENTS; i++)
+		counts[i] = perf_event_ok(i) ? rdpmc(i) : 0;
+}
+
+void
+perf_region_begin(struct PerfRegion *r)
+{
+	if (!r->listed) {
+		r->listed = 1;
+		r->next = perf_regions;
+		perf_regions = r;
+	}
+	perf_read(r->start);
+	r->start_tsc = read_tsc();
+}
+
+void
+perf_region_end(struct PerfRegion *r)
+{
+	uint64_t tsc = read_tsc(), now[PERF_NEVENTS];
+	int i;
+
+	perf_read(now);
+	r->tsc += tsc - r->start_tsc;
+	for (i = 0; i < PERF_NEVENTS; i++)
+		r->events[i] += (now[i] - r->start[i]) & perf_mask;
+	r->count++;
+}
+
+void
+perf_region_print(struct PerfRegion *r)
+{
+	int i;
+
+	cprintf("%s: %u runs, %llu tsc", r->name, r->count, r->tsc);
+	for (i = 0; i < PERF_NEVENTS; i++)
+		if (perf_event_ok(i))
+			cprintf(", %llu %s", r->events[i], perf_event_names[i]);
+	cprintf("\n");
+}
+
+// Print every region measured so far.
+void
+perf_report(void)
+{
+	struct PerfRegion *r;
+
+	if (perf_version == 0)
+		cprintf("perf: no PMU; reporting TSC only\n");
+	for (r = perf_regions; r; r = r->next)
+		perf_region_print(r);
+}
+
+void
+perf_reset(void)
+{
+	struct PerfRegion *r;
+
+	for (r = perf_regions; r; r = r->next) {
+		r->count = 0;
+		r->tsc = 0;
+		memset(r->events, 0, sizeof(r->events));
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef JOS_KERN_PERF_H
+#define JOS_KERN_PERF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Events counted by the architectural PMU, one per general-purpose counter.
+enum {
+	PERF_CYCLES = 0,	// unhalted core cycles
+	PERF_INSTRS,		// instructions retired
+	PERF_LLC_MISSES,	// last-level cache misses
+	PERF_DTLB_MISSES,	// dTLB load misses causing a page walk
+	PERF_NEVENTS
+};
+
+// A named code region measured with perf_region_begin/end.  Deltas of
+// every event are accumulated over all executions of the region.
+// Events the CPU can't count stay zero; 'tsc' is always available.
+struct PerfRegion {
+	const char *name;
+	uint32_t count;			// completed executions
+	uint64_t tsc;			// total TSC ticks
+	uint64_t events[PERF_NEVENTS];	// total event counts
+	// private
+	uint64_t start_tsc;
+	uint64_t start[PERF_NEVENTS];
+	bool listed;			// on the list of regions seen so far
+	struct PerfRegion *next;
+};
+
+extern const char * const perf_event_names[PERF_NEVENTS];
+
+void perf_init(void);
+bool perf_event_ok(int event);
+void perf_read(uint64_t counts[PERF_NEVENTS]);
+void perf_region_begin(struct PerfRegion *r);
+void perf_region_end(struct PerfRegion *r);
+void perf_region_print(struct PerfRegion *r);
+void perf_report(void);
+void perf_reset(void);
+
+#endif	// !JOS_KERN_PERF_H
@@ -5,58 +5,194 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/e820.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#ifdef PAGE_TRACK
+#include <kern/kdebug.h>
+#endif
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
-static size_t npages_basemem;	// Amount of base memory (in pages)
+static struct E820Map e820_map;	// BIOS memory map, from the boot loader
 
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+static struct PageInfo *page_free_list[NZONES];	// Free lists, per zone
+// Protects page_free_list and the lazy initialization of pages[].
+static struct McsLock page_lock = MCSLOCK_INIT("page_free_list");
+
+// Until kern_pgdir is loaded, only the low 4MB of physical memory is
+// mapped, so page_alloc must not hand out ZONE_NORMAL pages.
+static bool zone_normal_ready;
+#ifdef PAGE_TRACK
+static struct PageSite *page_sites;	// Allocation site of each page
+#endif
+
+// Entries of pages[] are initialized on demand.  page_init sets up
+// ZONE_LOW and ZONE_DMA, which is enough to boot; each higher zone is
+// initialized PAGE_INIT_CHUNK pages at a time when page_alloc finds it
+// empty, or from the console's idle loop, so boot time doesn't grow
+// with the amount of memory.
+#define PAGE_INIT_CHUNK	1024		// Pages per step (4MB)
+static size_t zone_init_next[NZONES];	// First uninitialized page, per zone
+static bool zone_init_chunk(int z);
+
+// Direct-mapped cache of recent pgdir_walk translations from
+// (page directory, PDX) to the kernel virtual address of the page table,
+// so walks over consecutive addresses skip the PDE decode.  Only present
+// page tables are cached.  Whoever changes or clears a present PDE must
+// call ptcache_invalidate.
+//
+// The cache is shared and unlocked, and there is no TLB shootdown yet, so
+// only the boot CPU may walk or change page tables; the APs just park.
+static struct {
+	pde_t *pgdir;
+	uint32_t pdx;
+	pte_t *pt;
+} ptcache[PTCACHE_SIZE];
+
+#define PTCACHE_SLOT(pgdir, pdx) \
+	((((uintptr_t) (pgdir) >> PGSHIFT) ^ (pdx)) & (PTCACHE_SIZE - 1))
+
+// Page tables allocated by pgdir_walk count their present entries in
+// pp_nlive.  Once pt_reclaim is set, a page table whose count drops to
+// zero is freed and its PDE cleared.
+static bool pt_reclaim;
+static void pt_ref(pde_t *pgdir, const void *va);
+static void pt_unref(pde_t *pgdir, const void *va);
+static void pt_free(pde_t *pgdir, const void *va);
 
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
 // --------------------------------------------------------------
 
+static void *boot_alloc(uint32_t n);
+
 static int
 nvram_read(int r)
 {
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+static const char *
+e820_type_name(uint32_t type)
+{
+	static const char * const names[] = {
+		[E820_RAM] = "usable",
+		[E820_RESERVED] = "reserved",
+		[E820_ACPI] = "ACPI data",
+		[E820_NVS] = "ACPI NVS",
+		[E820_UNUSABLE] = "unusable",
+	};
+
+	if (type < ARRAY_SIZE(names) && names[type])
+		return names[type];
+	return "unknown";
+}
+
+// Add [addr, addr+len) of 'type' to e820_map.
+static void
+e820_add(uint64_t addr, uint64_t len, uint32_t type)
+{
+	struct E820Entry *e;
+
+	if (e820_map.nr == E820_MAX)
+		return;
+	e = &e820_map.map[e820_map.nr++];
+	e->addr = addr;
+	e->len = len;
+	e->type = type;
+}
+
+// pages[] and the rest of boot_alloc's data must fit in the 4MB that
+// entry_pgdir maps, which caps the physical memory we can manage.
+// Returns the highest physical address whose page fits.
+static uint64_t
+boot_maxphys(void)
+{
+	uintptr_t free = (uintptr_t) boot_alloc(0);
+	size_t per_page = sizeof(struct PageInfo);
+	int nalloc = 2;		// kern_pgdir, pages[]
+
+#ifdef PAGE_TRACK
+	per_page += sizeof(struct PageSite);
+	nalloc++;		// page_sites[]
+#endif
+	// Each allocation may round up by up to a page.
+	return (uint64_t) ((KERNBASE + PTSIZE - free - nalloc * PGSIZE) / per_page)
+		* PGSIZE;
+}
+
 static void
 i386_detect_memory(void)
 {
 	size_t basemem, extmem, ext16mem, totalmem;
+	uint64_t start, end, maxphys = boot_maxphys();
+	uint32_t i;
+	bool clamped = 0;
+
+	// Copy the boot loader's map now, since its page will be freed.
+	// npages isn't known yet, so KADDR would panic; entry_pgdir maps
+	// low memory at KERNBASE.
+	memmove(&e820_map, (void *) (E820_MAP_PA + KERNBASE), sizeof(e820_map));
+	if (e820_map.nr > E820_MAX)
+		e820_map.nr = 0;
+
+	if (e820_map.nr == 0) {
+		// No E820; make do with the CMOS sizes (in kilobytes).
+		basemem = nvram_read(NVRAM_BASELO);
+		extmem = nvram_read(NVRAM_EXTLO);
+		ext16mem = nvram_read(NVRAM_EXT16LO) * 64;
+		e820_add(0, basemem * 1024, E820_RAM);
+		if (ext16mem)
+			e820_add(EXTPHYSMEM, (15 * 1024 + (uint64_t) ext16mem) * 1024,
+				 E820_RAM);
+		else if (extmem)
+			e820_add(EXTPHYSMEM, (uint64_t) extmem * 1024, E820_RAM);
+		CPRINTF_CACHED("e820: not supported, using CMOS sizes\n");
+	}
 
-	// Use CMOS calls to measure available base & extended memory.
-	// (CMOS calls return results in kilobytes.)
-	basemem = nvram_read(NVRAM_BASELO);
-	extmem = nvram_read(NVRAM_EXTLO);
-	ext16mem = nvram_read(NVRAM_EXT16LO) * 64;
-
-	// Calculate the number of physical pages available in both base
-	// and extended memory.
-	if (ext16mem)
-		totalmem = 16 * 1024 + ext16mem;
-	else if (extmem)
-		totalmem = 1 * 1024 + extmem;
-	else
-		totalmem = basemem;
-
-	npages = totalmem / (PGSIZE / 1024);
-	npages_basemem = basemem / (PGSIZE / 1024);
+	// npages reaches the end of the highest usable range.
+	npages = 0;
+	basemem = totalmem = 0;
+	for (i = 0; i < e820_map.nr; i++) {
+		start = e820_map.map[i].addr;
+		end = start + e820_map.map[i].len;
+		CPRINTF_CACHED("e820: [mem %08llx-%08llx] %s\n", start, end - 1,
+			       e820_type_name(e820_map.map[i].type));
+		if (e820_map.map[i].type != E820_RAM)
+			continue;
+		if (end > maxphys)
+			clamped = 1;
+		if (start >= maxphys)
+			continue;
+		end = MIN(end, maxphys);
+		npages = MAX(npages, (size_t) (end / PGSIZE));
+		totalmem += (end - start) / 1024;
+		if (start < IOPHYSMEM)
+			basemem += (MIN(end, (uint64_t) IOPHYSMEM) - start) / 1024;
+	}
+	if (npages == 0)
+		panic("i386_detect_memory: no usable memory");
 
-	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
+	if (clamped)
+		CPRINTF_CACHED("e820: ignoring memory above %lluK: its pages[] "
+			       "would not fit in the entry_pgdir map\n", maxphys / 1024);
+	CPRINTF_CACHED("Physical memory: %uK available, base = %uK, extended = %uK\n",
 		totalmem, basemem, totalmem - basemem);
+	if (npages > DIRECTMAP_SIZE / PGSIZE)
+		CPRINTF_CACHED("Highmem: %uK above the KERNBASE map\n",
+			       (npages - DIRECTMAP_SIZE / PGSIZE) * (PGSIZE / 1024));
 }
 
 
+
 // --------------------------------------------------------------
 // Set up memory mappings above UTOP.
 // --------------------------------------------------------------
@@ -65,9 +201,14 @@ static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
+static void mem_init_mp(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void check_page_reclaim(void);
+static void check_page_cow(void);
+static void check_page_transfer(void);
+static void check_kmap(void);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -104,6 +245,8 @@ boot_alloc(uint32_t n)
 	// LAB 2: Your code here.
   result = nextfree;
   nextfree = ROUNDUP((char *)result + n, PGSIZE);
+	if ((uintptr_t) nextfree > KERNBASE + PTSIZE)
+		panic("boot_alloc: out of memory mapped by entry_pgdir");
 	return result;
 }
 
@@ -122,7 +265,7 @@ mem_init(void)
 	uint32_t cr0;
 	size_t n;
 
-	// Find out how much memory the machine has (npages & npages_basemem).
+	// Find out how much memory the machine has (npages & e820_map).
 	i386_detect_memory();
 
 	// Remove this line when you're ready to test this function.
@@ -146,11 +289,15 @@ mem_init(void)
 	// Allocate an array of npages 'struct PageInfo's and store it in 'pages'.
 	// The kernel uses this array to keep track of physical pages: for
 	// each physical page, there is a corresponding struct PageInfo in this
-	// array.  'npages' is the number of physical pages in memory.  Use memset
-	// to initialize all fields of each struct PageInfo to 0.
+	// array.  'npages' is the number of physical pages in memory.
+	// page_init and zone_init_chunk fill in the entries, so there's no
+	// need to clear the whole array here.
 	// Your code goes here:
   pages = (struct PageInfo *)boot_alloc(sizeof(struct PageInfo) * npages);
-  memset((void *)pages, 0, sizeof(struct PageInfo) * npages);
+#ifdef PAGE_TRACK
+	page_sites = (struct PageSite *) boot_alloc(sizeof(struct PageSite) * npages);
+	memset(page_sites, 0, sizeof(struct PageSite) * npages);
+#endif
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -176,17 +323,9 @@ mem_init(void)
 	// Your code goes here:
   boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U);
 	//////////////////////////////////////////////////////////////////////
-	// Use the physical memory that 'bootstack' refers to as the kernel
-	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
-	// We consider the entire range from [KSTACKTOP-PTSIZE, KSTACKTOP)
-	// to be the kernel stack, but break this into two pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed; so if
-	//       the kernel overflows its stack, it will fault rather than
-	//       overwrite memory.  Known as a "guard page".
-	//     Permissions: kernel RW, user NONE
-	// Your code goes here:
-  boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
+	// Map the per-CPU kernel stacks below KSTACKTOP.
+	mem_init_mp();
+
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
 	// Ie.  the VA range [KERNBASE, 2^32) should map to
@@ -207,6 +346,7 @@ mem_init(void)
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
 	lcr3(PADDR(kern_pgdir));
+	zone_normal_ready = 1;
 
 	check_page_free_list(0);
 
@@ -219,6 +359,66 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// The checks above expect page tables to outlive their mappings;
+	// from now on empty page tables are freed.
+	pt_reclaim = 1;
+	check_page_reclaim();
+	check_page_cow();
+	check_page_transfer();
+	check_kmap();
+}
+
+// Modify mappings in kern_pgdir to support SMP
+//   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
+//
+static void
+mem_init_mp(void)
+{
+	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
+	//
+	// For CPU i, use the physical memory that 'percpu_kstacks[i]' refers
+	// to as its kernel stack. CPU i's kernel stack grows down from virtual
+	// address kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and is
+	// divided into two pieces, just like the single stack you set up in
+	// mem_init:
+	//     * [kstacktop_i - KSTKSIZE, kstacktop_i)
+	//          -- backed by physical memory
+	//     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+	//          -- not backed; so if the kernel overflows its stack,
+	//             it will fault rather than overwrite another CPU's stack.
+	//             Known as a "guard page".
+	//     Permissions: kernel RW, user NONE
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		boot_map_region(kern_pgdir, KSTACKTOP - i * (KSTKSIZE + KSTKGAP) - KSTKSIZE,
+				KSTKSIZE, PADDR(percpu_kstacks[i]), PTE_W);
+}
+
+//
+// Reserve size bytes in the MMIO region and map [pa,pa+size) at this
+// location.  Return the base of the reserved region.  size does *not*
+// have to be multiple of PGSIZE.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	// Where to start the next region.  Initially, this is the
+	// beginning of the MMIO region.  Because this is static, its
+	// value will be preserved between calls to mmio_map_region
+	// (just like nextfree in boot_alloc).
+	static uintptr_t base = MMIOBASE;
+	uintptr_t va = base;
+	physaddr_t start = ROUNDDOWN(pa, PGSIZE);
+
+	// Device memory must not be cached: map it with PTE_PCD|PTE_PWT.
+	size = ROUNDUP(pa + size, PGSIZE) - start;
+	if (size > MMIOLIM - base)
+		panic("mmio_map_region: out of MMIO space mapping %08x", pa);
+	boot_map_region(kern_pgdir, base, size, start, PTE_PCD | PTE_PWT | PTE_W);
+	base += size;
+	return (void *) (va + PGOFF(pa));
 }
 
 // --------------------------------------------------------------
@@ -227,54 +427,134 @@ mem_init(void)
 // Pages are reference counted, and free pages are kept on a linked list.
 // --------------------------------------------------------------
 
+// First page past zone 'z'.
+static size_t
+zone_limit(int z)
+{
+	static const size_t limits[NZONES] = {
+		[ZONE_LOW] = PGNUM(ZONE_DMA_START),
+		[ZONE_DMA] = PGNUM(ZONE_NORMAL_START),
+		[ZONE_NORMAL] = PGNUM(DIRECTMAP_SIZE),
+		[ZONE_HIGH] = ~(size_t) 0,
+	};
+
+	return MIN(limits[z], npages);
+}
+
+//
+// Initialize pages[first, last) and put the free ones on their zone's
+// free list.  Only RAM the BIOS map reports usable is free, except for:
+//  1) Physical page 0, which holds the real-mode IDT and BIOS
+//     structures, in case we ever need them.
+//  2) The IO hole [IOPHYSMEM, EXTPHYSMEM), in case the map doesn't
+//     exclude it.
+//  3) The kernel image and boot_alloc's data, from EXTPHYSMEM.
+// NB: DO NOT actually touch the physical memory corresponding to
+// free pages!
+//
+static void
+page_init_range(size_t first, size_t last)
+{
+	size_t i, j, lo, hi;
+	extern char end[];
+	// First page past the kernel image: where boot_alloc started.
+	size_t kern_end = PGNUM(ROUNDUP(PADDR(end), PGSIZE));
+	size_t boot_end = PGNUM(PADDR(boot_alloc(0)));
+	struct E820Entry *e;
+	int z;
+
+	for (i = first; i < last; i++) {
+		pages[i].pp_ref = 1;
+		pages[i].pp_link = NULL;
+		pages[i].pp_owner = PAGE_RESERVED;
+		pages[i].pp_nlive = 0;
+	}
+	for (i = MAX(first, PGNUM(IOPHYSMEM)); i < MIN(last, PGNUM(EXTPHYSMEM)); i++)
+		pages[i].pp_owner = PAGE_IOHOLE;
+	for (i = MAX(first, PGNUM(EXTPHYSMEM)); i < MIN(last, boot_end); i++)
+		pages[i].pp_owner = i < kern_end ? PAGE_KERNEL : PAGE_BOOT;
+
+	for (j = 0; j < e820_map.nr; j++) {
+		e = &e820_map.map[j];
+		if (e->type != E820_RAM || e->addr >= (uint64_t) last * PGSIZE)
+			continue;
+		// Only whole pages inside the range are usable.
+		lo = MAX((e->addr + PGSIZE - 1) / PGSIZE, (uint64_t) first);
+		hi = MIN((e->addr + e->len) / PGSIZE, (uint64_t) last);
+		for (i = MAX(lo, 1); i < hi; i++) {
+			// Skip the pages tagged above, and those an
+			// overlapping entry already freed.
+			if (pages[i].pp_owner != PAGE_RESERVED)
+				continue;
+			// boot_aps copies the AP entry code here.
+			if (i == PGNUM(MPENTRY_PADDR))
+				continue;
+			z = page_zone(&pages[i]);
+			pages[i].pp_ref = 0;
+			pages[i].pp_owner = PAGE_FREE;
+			pages[i].pp_link = page_free_list[z];
+			page_free_list[z] = &pages[i];
+		}
+	}
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the page_free_list lists.
 //
 void
 page_init(void)
 {
-	// The example code here marks all physical pages as free.
-	// However this is not truly the case.  What memory is free?
-	//  1) Mark physical page 0 as in use.
-	//     This way we preserve the real-mode IDT and BIOS structures
-	//     in case we ever need them.  (Currently we don't, but...)
-	//  2) The rest of base memory, [PGSIZE, npages_basemem * PGSIZE)
-	//     is free.
-	//  3) Then comes the IO hole [IOPHYSMEM, EXTPHYSMEM), which must
-	//     never be allocated.
-	//  4) Then extended memory [EXTPHYSMEM, ...).
-	//     Some of it is in use, some is free. Where is the kernel
-	//     in physical memory?  Which pages are already in use for
-	//     page tables and other data structures?
-	//
-	// Change the code to reflect this.
-	// NB: DO NOT actually touch the physical memory corresponding to
-	// free pages!
-	size_t i;
-	pages[0].pp_ref = 1;
-  pages[0].pp_link = NULL;
-  for(i = 1; i < npages_basemem; i++) {
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
-	}
-  for(i = IOPHYSMEM/PGSIZE; i < EXTPHYSMEM/PGSIZE; i++) {
-    pages[i].pp_ref = 1;
-    pages[i].pp_link = NULL;
-  }
-  size_t va_end = (size_t) (PADDR(boot_alloc(0))/PGSIZE);
-  for(i = EXTPHYSMEM/PGSIZE;i < va_end; i++) {
-    pages[i].pp_ref = 1;
-    pages[i].pp_link = NULL;
-  }
-  for(i = va_end; i < npages; i++) {
-    pages[i].pp_ref = 0;
-    pages[i].pp_link = page_free_list;
-    page_free_list = &pages[i];
-  }
+	int z;
+
+	for (z = 0; z < NZONES; z++)
+		zone_init_next[z] = z == 0 ? 0 : zone_limit(z - 1);
+	// Initialize enough to boot; the higher zones wait for page_alloc.
+	zone_init_next[ZONE_LOW] = zone_limit(ZONE_LOW);
+	zone_init_next[ZONE_DMA] = zone_limit(ZONE_DMA);
+	page_init_range(0, zone_limit(ZONE_DMA));
+}
+
+// Initialize the next chunk of zone 'z' in pages[].  Returns 0 if the
+// whole zone was already initialized.
+static bool
+zone_init_chunk(int z)
+{
+	size_t first = zone_init_next[z];
+	size_t last = MIN(first + PAGE_INIT_CHUNK, zone_limit(z));
+
+	if (first >= last)
+		return 0;
+	zone_init_next[z] = last;
+	page_init_range(first, last);
+	return 1;
+}
+
+//
+// Initialize one more chunk of pages[], for callers with nothing better
+// to do.  Returns 0 once all of pages[] is initialized.
+//
+bool
+page_init_idle(void)
+{
+	struct McsNode node;
+	bool more = 0;
+	int z;
+
+	mcs_lock(&page_lock, &node);
+	for (z = ZONE_NORMAL; z < NZONES && !more; z++)
+		more = zone_init_chunk(z);
+	mcs_unlock(&page_lock, &node);
+	return more;
+}
+
+// Whether pages[i] has been initialized.
+static bool
+page_initialized(size_t i)
+{
+	return i < zone_init_next[page_zone(&pages[i])];
 }
 
 //
@@ -286,6 +566,10 @@ page_init(void)
 // Be sure to set the pp_link field of the allocated page to NULL so
 // page_free can check for double-free bugs.
 //
+// The page comes from ZONE_NORMAL, or from ZONE_HIGH with ALLOC_HIGH,
+// ZONE_DMA with ALLOC_DMA, or ZONE_LOW with ALLOC_LOW; if that zone is
+// empty, from the next lower zone that isn't.
+//
 // Returns NULL if out of free memory.
 //
 // Hint: use page2kva and memset
@@ -293,13 +577,39 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-  struct PageInfo *pg = page_free_list;
-  if(!pg) return NULL;
+	struct McsNode node;
+	int z;
+
+	if (alloc_flags & ALLOC_LOW)
+		z = ZONE_LOW;
+	else if ((alloc_flags & ALLOC_DMA) || !zone_normal_ready)
+		z = ZONE_DMA;
+	else if (alloc_flags & ALLOC_HIGH)
+		z = ZONE_HIGH;
+	else
+		z = ZONE_NORMAL;
+	mcs_lock(&page_lock, &node);
+	while (z > 0 && !page_free_list[z])
+		if (!zone_init_chunk(z))
+			z--;
+  struct PageInfo *pg = page_free_list[z];
+  if(!pg) {
+    mcs_unlock(&page_lock, &node);
+    return NULL;
+  }
   // must check pg first__a pain cost for me!
-  page_free_list = pg->pp_link;
+  page_free_list[z] = pg->pp_link;
   pg->pp_link = NULL;
+  pg->pp_owner = PAGE_ALLOC;
+	mcs_unlock(&page_lock, &node);
+#ifdef PAGE_TRACK
+	memset(&page_sites[pg - pages], 0, sizeof(struct PageSite));
+	backtrace_capture(page_sites[pg - pages].ps_pcs, PAGE_TRACK_DEPTH);
+#endif
   if(alloc_flags & ALLOC_ZERO) {
-    memset(page2kva(pg), '\0', PGSIZE);
+    void *kva = kmap(pg);
+    memset(kva, '\0', PGSIZE);
+    kunmap(kva);
   } 
 	return pg;
 }
@@ -315,8 +625,16 @@ page_free(struct PageInfo *pp)
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
   if(pp->pp_ref || (pp->pp_link)) panic("page_free: not empty pg!\n");
-  pp->pp_link = page_free_list;
-  page_free_list = pp;
+  int z = page_zone(pp);
+  struct McsNode node;
+  mcs_lock(&page_lock, &node);
+  pp->pp_link = page_free_list[z];
+  pp->pp_owner = PAGE_FREE;
+  page_free_list[z] = pp;
+  mcs_unlock(&page_lock, &node);
+#ifdef PAGE_TRACK
+	page_sites[pp - pages].ps_pcs[0] = 0;
+#endif
 }
 
 //
@@ -356,15 +674,117 @@ pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	// Fill this function in
+	uint32_t slot = PTCACHE_SLOT(pgdir, PDX(va));
+
+	assert(cpunum() == 0);
+	if (ptcache[slot].pgdir == pgdir && ptcache[slot].pdx == PDX(va))
+		return ptcache[slot].pt + PTX(va);
+
   pte_t *pte = pgdir + PDX(va);
   if(!(*pte & PTE_P)) {
     if(!create) return NULL;
     struct PageInfo * pg = page_alloc(1);
     if(!pg) return NULL;
     pg->pp_ref++;
+    pg->pp_owner = PAGE_PGTABLE;
+    pg->pp_nlive = 0;
     *pte = page2pa(pg) | PTE_U | PTE_W | PTE_P;
   }
-  return (pte_t *)KADDR(PTE_ADDR(*pte)) + PTX(va);
+	ptcache[slot].pgdir = pgdir;
+	ptcache[slot].pdx = PDX(va);
+	ptcache[slot].pt = (pte_t *) KADDR(PTE_ADDR(*pte));
+	return ptcache[slot].pt + PTX(va);
+}
+
+//
+// Forget any cached pgdir_walk translation for the page table covering
+// 'va' in 'pgdir'.  Must be called after the PDE for 'va' is cleared or
+// pointed at a different page table.  Permission-only changes to a PDE
+// don't need it.
+//
+void
+ptcache_invalidate(pde_t *pgdir, const void *va)
+{
+	uint32_t slot = PTCACHE_SLOT(pgdir, PDX(va));
+
+	if (ptcache[slot].pgdir == pgdir && ptcache[slot].pdx == PDX(va))
+		ptcache[slot].pgdir = NULL;
+	// The page table was also visible through the UVPT window.
+	tlb_invalidate(pgdir, (void *) &uvpt[PDX(va) * NPTENTRIES]);
+}
+
+//
+// Set the PTE for 'va' in 'pgdir' to 'pte', allocating a page table if
+// needed.  The caller handles the TLB.  This is the write side of
+// pte_get; it can't use the UVPT window because that is read-only.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//
+int
+pte_set(pde_t *pgdir, const void *va, pte_t pte)
+{
+	pte_t *ptep = pgdir_walk(pgdir, va, 1);
+	pte_t old;
+
+	if (!ptep)
+		return -E_NO_MEM;
+	if (pte & PTE_P)
+		pt_ref(pgdir, va);
+	old = *ptep;
+	*ptep = pte;
+	if (old & PTE_P)
+		pt_unref(pgdir, va);
+	return 0;
+}
+
+static inline struct PageInfo *
+pt_page(pde_t *pgdir, const void *va)
+{
+	return pa2page(PTE_ADDR(pgdir[PDX(va)]));
+}
+
+// Count a new present entry in the page table covering 'va'.
+// Tables that pgdir_walk didn't allocate, such as the UVPT self-map,
+// are not counted.
+static void
+pt_ref(pde_t *pgdir, const void *va)
+{
+	struct PageInfo *pt = pt_page(pgdir, va);
+
+	if (pt->pp_owner == PAGE_PGTABLE)
+		pt->pp_nlive++;
+}
+
+// The present entry for 'va' has just been cleared.  If that emptied
+// its page table, free the table.
+static void
+pt_unref(pde_t *pgdir, const void *va)
+{
+	struct PageInfo *pt = pt_page(pgdir, va);
+
+	if (pt->pp_owner != PAGE_PGTABLE)
+		return;
+	assert(pt->pp_nlive > 0);
+	if (--pt->pp_nlive > 0 || !pt_reclaim)
+		return;
+	pt_free(pgdir, va);
+}
+
+// Clear the PDE for 'va' and free its page table, which has no present
+// entries.
+static void
+pt_free(pde_t *pgdir, const void *va)
+{
+	struct PageInfo *pt = pt_page(pgdir, va);
+
+	pgdir[PDX(va)] = 0;
+	ptcache_invalidate(pgdir, va);
+	// The table had no present entries, so the TLB holds no
+	// translations through it; this flushes the cached PDE.
+	tlb_invalidate(pgdir, (void *) va);
+	page_decref(pt);
 }
 
 //
@@ -387,6 +807,7 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
   for(size_t i = 0; i < num; i++) {
     pte = pgdir_walk(pgdir, (void *)va, 1);
     if(!pte) panic("boot_map: page alloc error!\n");
+    if(!(*pte & PTE_P)) pt_ref(pgdir, (void *)va);
     *pte = pa | perm | PTE_P;
     pa += PGSIZE;
     va += PGSIZE;
@@ -425,11 +846,15 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
   pte_t *pte = pgdir_walk(pgdir, va, 1);
   if(!pte) return -E_NO_MEM;
   pp->pp_ref++;
+  // Count the new entry before removing the old one, so that the
+  // removal can't reclaim the page table.
+  pt_ref(pgdir, va);
   if((*pte) & PTE_P) {
     page_remove(pgdir, va);
   }
   physaddr_t pa = page2pa(pp);
   *pte = pa | perm | PTE_P;
+  if((uintptr_t)va < UTOP) pp->pp_owner = PAGE_USER;
   pgdir[PDX(va)] |=perm;
 
 	return 0;
@@ -450,6 +875,12 @@ struct PageInfo *
 page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 {
 	// Fill this function in
+	// Callers that don't need the PTE's address can use pte_get,
+	// which reads the loaded pgdir through UVPT.
+	if (!pte_store) {
+		pte_t e = pte_get(pgdir, va);
+		return (e & PTE_P) ? pa2page(PTE_ADDR(e)) : NULL;
+	}
   pte_t *pte = pgdir_walk(pgdir, va, 0);
   if(pte && (*pte & PTE_P)) {
     physaddr_t pa = PTE_ADDR(*pte);
@@ -484,6 +915,7 @@ page_remove(pde_t *pgdir, void *va)
   page_decref(pg);
   *pte = 0;
   tlb_invalidate(pgdir ,va);
+  pt_unref(pgdir, va);
   
 }
 
@@ -499,6 +931,411 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	invlpg(va);
 }
 
+//
+// Flush all non-global TLB entries if 'pgdir' is the loaded page
+// directory.  Cheaper than tlb_invalidate for large batches.
+//
+void
+tlb_flush(pde_t *pgdir)
+{
+	if (rcr3() == PADDR(pgdir))
+		lcr3(PADDR(pgdir));
+}
+
+
+// --------------------------------------------------------------
+// Temporary mappings for high memory.
+// --------------------------------------------------------------
+
+// One page of [KMAPBASE, KMAPBASE + NKMAP*PGSIZE) each.  A slot keeps
+// its mapping after its last kunmap, so mapping the same page again
+// is free; the TLB entry is only flushed when the slot is reused.
+//
+// Reusing a slot flushes only the local TLB, so until there is TLB
+// shootdown only the boot CPU may kmap high pages.  kmap_lock keeps
+// interrupt handlers out of the slot table meanwhile.
+static struct {
+	struct PageInfo *pp;		// Page mapped in the slot, or NULL
+	int ref;			// Outstanding kmaps
+} kmap_slots[NKMAP];
+static struct Spinlock kmap_lock = SPINLOCK_INIT("kmap_slots");
+
+//
+// Return a kernel virtual address for page 'pp': its address in the
+// KERNBASE map, or for ZONE_HIGH pages a kmap slot.  Every kmap must be
+// paired with a kunmap.  Panics if all slots are in use, or if a high
+// page is mapped on any CPU but the boot CPU.
+//
+void *
+kmap(struct PageInfo *pp)
+{
+	int i, slot = -1;
+	void *va;
+	pte_t *pte;
+
+	if (page_zone(pp) != ZONE_HIGH)
+		return page2kva(pp);
+	if (cpunum() != 0)
+		panic("kmap: CPU %d can't map high pages", cpunum());
+	spin_lock(&kmap_lock);
+	for (i = 0; i < NKMAP; i++) {
+		if (kmap_slots[i].pp == pp) {
+			kmap_slots[i].ref++;
+			spin_unlock(&kmap_lock);
+			return (void *) (KMAPBASE + i * PGSIZE);
+		}
+		if (kmap_slots[i].ref == 0 && (slot < 0 || !kmap_slots[i].pp))
+			slot = i;
+	}
+	if (slot < 0)
+		panic("kmap: all %d slots in use", NKMAP);
+
+	// The slots share a page table with the kernel stack, which keeps
+	// it alive, so the slot PTEs aren't counted in pp_nlive.
+	va = (void *) (KMAPBASE + slot * PGSIZE);
+	pte = pgdir_walk(kern_pgdir, va, 0);
+	assert(pte);
+	*pte = page2pa(pp) | PTE_W | PTE_P;
+	if (kmap_slots[slot].pp)
+		tlb_invalidate(kern_pgdir, va);
+	kmap_slots[slot].pp = pp;
+	kmap_slots[slot].ref = 1;
+	spin_unlock(&kmap_lock);
+	return va;
+}
+
+//
+// Release an address returned by kmap.
+//
+void
+kunmap(void *kva)
+{
+	uintptr_t va = (uintptr_t) kva;
+
+	if (va < KMAPBASE || va >= KMAPBASE + NKMAP * PGSIZE)
+		return;
+	spin_lock(&kmap_lock);
+	assert(kmap_slots[(va - KMAPBASE) / PGSIZE].ref > 0);
+	kmap_slots[(va - KMAPBASE) / PGSIZE].ref--;
+	spin_unlock(&kmap_lock);
+}
+
+
+// --------------------------------------------------------------
+// Copy-on-write sharing.
+// --------------------------------------------------------------
+
+//
+// Share the pages mapped in [va, va+len) of 'src_pgdir' with 'dst_pgdir'
+// at the same addresses.  Writable and copy-on-write pages become
+// read-only PTE_COW in both; read-only pages are shared as they are.
+// Only page tables are touched, never page contents.  va and len must
+// be page-aligned and the range must lie below UTOP.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if the range is misaligned or reaches above UTOP
+//   -E_NO_MEM, if a page table for 'dst_pgdir' couldn't be allocated
+//
+int
+page_share_cow(pde_t *src_pgdir, pde_t *dst_pgdir, uintptr_t va, size_t len)
+{
+	uintptr_t end = va + len;
+	pte_t *pte;
+	int perm, r = 0;
+	bool flush = 0;
+
+	if (va % PGSIZE || len % PGSIZE || end < va || end > UTOP)
+		return -E_INVAL;
+	while (va < end) {
+		if (!(pte = pgdir_walk(src_pgdir, (void *) va, 0))) {
+			// No page table: skip to the next one.
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+			continue;
+		}
+		if (*pte & PTE_P) {
+			perm = *pte & (PTE_SYSCALL | PTE_COW);
+			if (perm & (PTE_W | PTE_COW)) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				if (*pte & PTE_W)
+					flush = 1;
+				*pte = PTE_ADDR(*pte) | perm;
+			}
+			if ((r = page_insert(dst_pgdir, pa2page(PTE_ADDR(*pte)),
+					     (void *) va, perm)) < 0)
+				break;
+		}
+		va += PGSIZE;
+	}
+	// Write access must be gone from the source before it returns.
+	if (flush)
+		tlb_flush(src_pgdir);
+	return r;
+}
+
+//
+// Resolve a write to the copy-on-write page at 'va' in 'pgdir'.  If the
+// page is still shared, copy it into a fresh page mapped writable in
+// its place; if this is its last mapping, just make it writable again.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT, if 'va' isn't mapped copy-on-write
+//   -E_NO_MEM, if there was no memory for the copy
+//
+int
+page_cow_break(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *np;
+	pte_t *pte;
+	void *src, *dst;
+	int perm;
+
+	pte = pgdir_walk(pgdir, va, 0);
+	if (!pte || (*pte & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+		return -E_FAULT;
+	pp = pa2page(PTE_ADDR(*pte));
+	perm = (*pte & PTE_SYSCALL) | PTE_W;
+
+	if (pp->pp_ref == 1) {
+		*pte = PTE_ADDR(*pte) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (!(np = page_alloc(ALLOC_HIGH)))
+		return -E_NO_MEM;
+	dst = kmap(np);
+	src = kmap(pp);
+	memmove(dst, src, PGSIZE);
+	kunmap(src);
+	kunmap(dst);
+	// page_insert drops our reference to pp and flushes the TLB.
+	return page_insert(pgdir, np, ROUNDDOWN(va, PGSIZE), perm);
+}
+
+//
+// Map the 'n' pages at 'srcva' in 'src_pgdir' at 'dstva' in 'dst_pgdir'
+// with permissions 'perm' | PTE_P, replacing whatever was mapped there.
+// With XFER_MOVE the pages are also unmapped from the source.  Only
+// PTEs and reference counts change; page contents are never copied,
+// and each side's TLB is flushed at most once for the whole batch.
+// Copy-on-write source pages stay copy-on-write in the destination.
+// On error nothing has been transferred.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if an address is misaligned or not below UTOP, the ranges
+//	overlap in one pgdir, perm is invalid, a source page isn't
+//	mapped, or perm has PTE_W but a source page is read-only
+//   -E_NO_MEM, if a destination page table couldn't be allocated
+//
+int
+page_transfer(pde_t *src_pgdir, uintptr_t srcva, pde_t *dst_pgdir,
+	      uintptr_t dstva, size_t n, int perm, int flags)
+{
+	struct PageInfo *pp;
+	pte_t *spte, *dpte;
+	size_t i, off;
+	uint32_t pdx, created[NPDENTRIES / 32];
+	bool dst_flush = 0;
+
+	if (srcva % PGSIZE || dstva % PGSIZE || srcva >= UTOP || dstva >= UTOP
+	    || n > (UTOP - srcva) / PGSIZE || n > (UTOP - dstva) / PGSIZE
+	    || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+	if (src_pgdir == dst_pgdir && srcva < dstva + n * PGSIZE
+	    && dstva < srcva + n * PGSIZE)
+		return -E_INVAL;
+
+	// Check every source before changing anything.
+	for (i = 0, off = 0; i < n; i++, off += PGSIZE) {
+		spte = pgdir_walk(src_pgdir, (void *) (srcva + off), 0);
+		if (!spte || !(*spte & PTE_P))
+			return -E_INVAL;
+		if ((perm & PTE_W) && !(*spte & PTE_W))
+			return -E_INVAL;
+	}
+
+	// Allocate the missing destination page tables.  If one can't be,
+	// free the ones this call made, which have no entries yet.
+	memset(created, 0, sizeof(created));
+	for (pdx = PDX(dstva); n > 0 && pdx <= PDX(dstva + (n - 1) * PGSIZE); pdx++) {
+		if (dst_pgdir[pdx] & PTE_P)
+			continue;
+		if (!pgdir_walk(dst_pgdir, PGADDR(pdx, 0, 0), 1)) {
+			while (pdx-- > PDX(dstva))
+				if (created[pdx / 32] & (1U << (pdx % 32)))
+					pt_free(dst_pgdir, PGADDR(pdx, 0, 0));
+			return -E_NO_MEM;
+		}
+		created[pdx / 32] |= 1U << (pdx % 32);
+	}
+
+	for (i = 0, off = 0; i < n; i++, off += PGSIZE) {
+		spte = pgdir_walk(src_pgdir, (void *) (srcva + off), 0);
+		dpte = pgdir_walk(dst_pgdir, (void *) (dstva + off), 0);
+		pp = pa2page(PTE_ADDR(*spte));
+		pp->pp_ref++;
+		pp->pp_owner = PAGE_USER;
+		if (*dpte & PTE_P) {
+			page_decref(pa2page(PTE_ADDR(*dpte)));
+			dst_flush = 1;
+		} else
+			pt_ref(dst_pgdir, (void *) (dstva + off));
+		*dpte = PTE_ADDR(*spte) | perm | (*spte & PTE_COW) | PTE_P;
+		if (flags & XFER_MOVE) {
+			*spte = 0;
+			page_decref(pp);
+			pt_unref(src_pgdir, (void *) (srcva + off));
+		}
+	}
+
+	if (dst_flush)
+		tlb_flush(dst_pgdir);
+	if ((flags & XFER_MOVE) && n > 0)
+		tlb_flush(src_pgdir);
+	return 0;
+}
+
+
+// --------------------------------------------------------------
+// Physical memory accounting.
+// --------------------------------------------------------------
+
+static const char * const page_owner_names[NPAGE_OWNERS] = {
+	[PAGE_FREE]	= "free",
+	[PAGE_RESERVED]	= "reserved",
+	[PAGE_IOHOLE]	= "I/O hole",
+	[PAGE_KERNEL]	= "kernel image",
+	[PAGE_BOOT]	= "boot_alloc",
+	[PAGE_PGTABLE]	= "page table",
+	[PAGE_USER]	= "user",
+	[PAGE_SLAB]	= "slab",
+	[PAGE_ALLOC]	= "kernel alloc",
+};
+
+// Print the number of pages in each PAGE_* category, a histogram of
+// the lengths of physically contiguous free runs (bucket k counts runs
+// of [2^k, 2^(k+1)) pages), and the largest free run.
+void
+page_meminfo(void)
+{
+	static const char * const zone_names[NZONES] = {
+		[ZONE_LOW] = "low", [ZONE_DMA] = "dma", [ZONE_NORMAL] = "normal",
+		[ZONE_HIGH] = "high"
+	};
+	static size_t count[NPAGE_OWNERS];
+	static size_t runs[32];
+	size_t zfree[NZONES];
+	size_t i, run, best, best_start, start, ndeferred = 0;
+	bool init;
+	int k;
+
+	memset(count, 0, sizeof(count));
+	memset(runs, 0, sizeof(runs));
+	memset(zfree, 0, sizeof(zfree));
+	run = best = best_start = start = 0;
+	for (i = 0; i <= npages; i++) {
+		init = i < npages && page_initialized(i);
+		if (init && pages[i].pp_owner == PAGE_FREE) {
+			if (run++ == 0)
+				start = i;
+		} else if (run) {
+			for (k = 0; (run >> (k + 1)) != 0; k++)
+				/* do nothing */;
+			runs[k]++;
+			if (run > best) {
+				best = run;
+				best_start = start;
+			}
+			run = 0;
+		}
+		if (init)
+			count[pages[i].pp_owner]++;
+		else if (i < npages)
+			ndeferred++;
+		if (init && pages[i].pp_owner == PAGE_FREE)
+			zfree[page_zone(&pages[i])]++;
+	}
+
+	cprintf("%u pages (%uK)\n", npages, npages * PGSIZE / 1024);
+	for (k = 0; k < NPAGE_OWNERS; k++)
+		cprintf("  %-13s %6u  %7uK\n", page_owner_names[k],
+			count[k], count[k] * PGSIZE / 1024);
+	if (ndeferred)
+		cprintf("  %-13s %6u  %7uK\n", "uninitialized",
+			ndeferred, ndeferred * PGSIZE / 1024);
+	cprintf("free by zone:");
+	for (k = 0; k < NZONES; k++)
+		cprintf(" %s %uK", zone_names[k], zfree[k] * PGSIZE / 1024);
+	cprintf("\nfree runs:\n");
+	for (k = 0; k < 32; k++)
+		if (runs[k])
+			cprintf("  %6u - %6u  %6u\n", 1u << k,
+				(2u << k) - 1, runs[k]);
+	if (best)
+		cprintf("largest free block: %u pages (%uK) at pa %08x\n",
+			best, best * PGSIZE / 1024, best_start * PGSIZE);
+}
+
+#ifdef PAGE_TRACK
+// Print the 'topn' call sites holding the most allocated pages, with
+// the call stack recorded for one page from each site.  Pages handed
+// out by page_init rather than page_alloc have no site and are skipped.
+void
+page_sites_report(int topn)
+{
+	static struct {
+		const struct PageSite *ps;
+		size_t count;
+	} sites[PAGE_TRACK_NSITES + 1];	// last slot is swap space
+	size_t i, nlive = 0, nother = 0;
+	int nsites = 0, j, k, best, depth;
+
+	for (i = 0; i < npages; i++) {
+		uintptr_t pc = page_sites[i].ps_pcs[0];
+
+		if (pc == 0 || pages[i].pp_owner == PAGE_FREE)
+			continue;
+		nlive++;
+		for (j = 0; j < nsites && sites[j].ps->ps_pcs[0] != pc; j++)
+			/* do nothing */;
+		if (j == nsites) {
+			if (nsites == PAGE_TRACK_NSITES) {
+				nother++;
+				continue;
+			}
+			sites[j].ps = &page_sites[i];
+			sites[j].count = 0;
+			nsites++;
+		}
+		sites[j].count++;
+	}
+
+	cprintf("%u live pages from %d sites", nlive, nsites);
+	if (nother)
+		cprintf(", %u from untracked sites", nother);
+	cprintf("\n");
+	// Selection sort; topn is small.
+	for (j = 0; j < topn && j < nsites; j++) {
+		for (best = k = j; k < nsites; k++)
+			if (sites[k].count > sites[best].count)
+				best = k;
+		if (best != j) {
+			sites[nsites] = sites[j];
+			sites[j] = sites[best];
+			sites[best] = sites[nsites];
+		}
+		for (depth = 0; depth < PAGE_TRACK_DEPTH
+			     && sites[j].ps->ps_pcs[depth]; depth++)
+			/* do nothing */;
+		cprintf("%u pages (%uK):\n", sites[j].count,
+			sites[j].count * PGSIZE / 1024);
+		backtrace_print(sites[j].ps->ps_pcs, depth);
+	}
+}
+#endif
+
 
 // --------------------------------------------------------------
 // Checking functions.
@@ -514,55 +1351,62 @@ check_page_free_list(bool only_low_memory)
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int z;
 
-	if (!page_free_list)
+	if (!page_free_list[ZONE_LOW] || !page_free_list[ZONE_DMA])
 		panic("'page_free_list' is a null pointer!");
 
-	if (only_low_memory) {
+	for (z = 0; only_low_memory && z < NZONES; z++) {
 		// Move pages with lower addresses first in the free
 		// list, since entry_pgdir does not map all pages.
 		struct PageInfo *pp1, *pp2;
 		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
+		for (pp = page_free_list[z]; pp; pp = pp->pp_link) {
 			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
 			*tp[pagetype] = pp;
 			tp[pagetype] = &pp->pp_link;
 		}
 		*tp[1] = 0;
 		*tp[0] = pp2;
-		page_free_list = pp1;
+		page_free_list[z] = pp1;
 	}
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (z = 0; z < NZONES; z++)
+		for (pp = page_free_list[z]; pp; pp = pp->pp_link)
+			if (PDX(page2pa(pp)) < pdx_limit && z != ZONE_HIGH)
+				memset(page2kva(pp), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (z = 0; z < NZONES; z++) {
+		for (pp = page_free_list[z]; pp; pp = pp->pp_link) {
+			// check that we didn't corrupt the free list itself
+			assert(pp >= pages);
+			assert(pp < pages + npages);
+			assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+
+			// check a few pages that shouldn't be on the free list
+			assert(page2pa(pp) != 0);
+			assert(page2pa(pp) != IOPHYSMEM);
+			assert(page2pa(pp) != MPENTRY_PADDR);
+			assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+			assert(page2pa(pp) != EXTPHYSMEM);
+			assert(page2pa(pp) < EXTPHYSMEM || page2pa(pp) >= PADDR(first_free_page));
+			assert(pp->pp_owner == PAGE_FREE);
+			assert(page_zone(pp) == z);
+
+			if (page2pa(pp) < EXTPHYSMEM)
+				++nfree_basemem;
+			else
+				++nfree_extmem;
+		}
 	}
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
 
-	cprintf("check_page_free_list() succeeded!\n");
+	CPRINTF_CACHED("check_page_free_list() succeeded!\n");
 }
 
 //
@@ -574,16 +1418,24 @@ check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct PageInfo *fl;
+	struct PageInfo *fl[NZONES];
 	char *c;
-	int i;
+	int i, z;
 
 	if (!pages)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = 0;
+	for (z = 0; z < NZONES; z++)
+		for (pp = page_free_list[z]; pp; pp = pp->pp_link)
+			++nfree;
+
+	// zone requests are honoured
+	assert((pp = page_alloc(ALLOC_LOW)) && page_zone(pp) == ZONE_LOW);
+	page_free(pp);
+	assert((pp = page_alloc(ALLOC_DMA)) && page_zone(pp) <= ZONE_DMA);
+	page_free(pp);
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -599,8 +1451,8 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	memmove(fl, page_free_list, sizeof(fl));
+	memset(page_free_list, 0, sizeof(page_free_list));
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -628,7 +1480,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	memmove(page_free_list, fl, sizeof(fl));
 
 	// free the pages we took
 	page_free(pp0);
@@ -636,11 +1488,12 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
+	for (z = 0; z < NZONES; z++)
+		for (pp = page_free_list[z]; pp; pp = pp->pp_link)
+			--nfree;
 	assert(nfree == 0);
 
-	cprintf("check_page_alloc() succeeded!\n");
+	CPRINTF_CACHED("check_page_alloc() succeeded!\n");
 }
 
 //
@@ -666,12 +1519,18 @@ check_kern_pgdir(void)
 
 
 	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+	for (i = 0; i < MIN(npages * PGSIZE, DIRECTMAP_SIZE); i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
-	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+	// check per-CPU kernel stacks and their guard gaps
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+			       == PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == ~0);
+	}
 	assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
 
 	// check PDE permissions
@@ -691,7 +1550,7 @@ check_kern_pgdir(void)
 			break;
 		}
 	}
-	cprintf("check_kern_pgdir() succeeded!\n");
+	CPRINTF_CACHED("check_kern_pgdir() succeeded!\n");
 }
 
 // This function returns the physical address of the page containing 'va',
@@ -719,7 +1578,7 @@ static void
 check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
+	struct PageInfo *fl[NZONES];
 	pte_t *ptep, *ptep1;
 	void *va;
 	int i;
@@ -736,8 +1595,8 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	memmove(fl, page_free_list, sizeof(fl));
+	memset(page_free_list, 0, sizeof(page_free_list));
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -834,6 +1693,7 @@ check_page(void)
 	// forcibly take pp0 back
 	assert(PTE_ADDR(kern_pgdir[0]) == page2pa(pp0));
 	kern_pgdir[0] = 0;
+	ptcache_invalidate(kern_pgdir, 0x0);
 	assert(pp0->pp_ref == 1);
 	pp0->pp_ref = 0;
 
@@ -843,7 +1703,11 @@ check_page(void)
 	ptep = pgdir_walk(kern_pgdir, va, 1);
 	ptep1 = (pte_t *) KADDR(PTE_ADDR(kern_pgdir[PDX(va)]));
 	assert(ptep == ptep1 + PTX(va));
+	// the cached walk must agree with the PDE
+	assert(pgdir_walk(kern_pgdir, va + PGSIZE, 0) == ptep + 1);
 	kern_pgdir[PDX(va)] = 0;
+	ptcache_invalidate(kern_pgdir, va);
+	assert(!pgdir_walk(kern_pgdir, va, 0));
 	pp0->pp_ref = 0;
 
 	// check that new page tables get cleared
@@ -854,17 +1718,18 @@ check_page(void)
 	for(i=0; i<NPTENTRIES; i++)
 		assert((ptep[i] & PTE_P) == 0);
 	kern_pgdir[0] = 0;
+	ptcache_invalidate(kern_pgdir, 0x0);
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	memmove(page_free_list, fl, sizeof(fl));
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
-	cprintf("check_page() succeeded!\n");
+	CPRINTF_CACHED("check_page() succeeded!\n");
 }
 
 // check page_insert, page_remove, &c, with an installed kern_pgdir
@@ -894,17 +1759,199 @@ check_page_installed_pgdir(void)
 	assert(pp1->pp_ref == 0);
 	*(uint32_t *)PGSIZE = 0x03030303U;
 	assert(*(uint32_t *)page2kva(pp2) == 0x03030303U);
+	// kern_pgdir is loaded, so these read through UVPT
+	assert(pte_get(kern_pgdir, (void*) PGSIZE) == *pgdir_walk(kern_pgdir, (void*) PGSIZE, 0));
+	assert(page_lookup(kern_pgdir, (void*) PGSIZE, 0) == pp2);
 	page_remove(kern_pgdir, (void*) PGSIZE);
 	assert(pp2->pp_ref == 0);
+	assert(!(pte_get(kern_pgdir, (void*) PGSIZE) & PTE_P));
 
 	// forcibly take pp0 back
 	assert(PTE_ADDR(kern_pgdir[0]) == page2pa(pp0));
 	kern_pgdir[0] = 0;
+	ptcache_invalidate(kern_pgdir, 0x0);
+	assert(pte_get(kern_pgdir, 0x0) == 0);
 	assert(pp0->pp_ref == 1);
 	pp0->pp_ref = 0;
 
 	// free the pages we took
 	page_free(pp0);
 
-	cprintf("check_page_installed_pgdir() succeeded!\n");
+	CPRINTF_CACHED("check_page_installed_pgdir() succeeded!\n");
+}
+
+// check that a page table is freed when its last mapping is removed
+static void
+check_page_reclaim(void)
+{
+	struct PageInfo *pp, *pt;
+	void *va = (void *) (3 * PTSIZE);
+
+	assert(!(kern_pgdir[PDX(va)] & PTE_P));
+	assert((pp = page_alloc(0)));
+	assert(page_insert(kern_pgdir, pp, va, PTE_W) == 0);
+	assert(page_insert(kern_pgdir, pp, va + PGSIZE, PTE_W) == 0);
+	pt = pa2page(PTE_ADDR(kern_pgdir[PDX(va)]));
+	assert(pt->pp_owner == PAGE_PGTABLE);
+	assert(pt->pp_ref == 1 && pt->pp_nlive == 2);
+
+	// replacing a mapping keeps the count
+	assert(page_insert(kern_pgdir, pp, va, PTE_W|PTE_U) == 0);
+	assert(pt->pp_nlive == 2);
+	assert(pp->pp_ref == 2);
+
+	// the table survives until its last entry goes
+	page_remove(kern_pgdir, va);
+	assert(pt->pp_nlive == 1);
+	assert(kern_pgdir[PDX(va)] & PTE_P);
+	page_remove(kern_pgdir, va + PGSIZE);
+	assert(kern_pgdir[PDX(va)] == 0);
+	assert(pt->pp_ref == 0 && pt->pp_owner == PAGE_FREE);
+	assert(pp->pp_ref == 0 && pp->pp_owner == PAGE_FREE);
+	assert(!pgdir_walk(kern_pgdir, va, 0));
+	assert(pte_get(kern_pgdir, va) == 0);
+
+	CPRINTF_CACHED("check_page_reclaim() succeeded!\n");
+}
+
+// check copy-on-write sharing between two page directories
+static void
+check_page_cow(void)
+{
+	struct PageInfo *pp, *pd;
+	pde_t *pgdir;
+	pte_t *ptep;
+	char *va = (char *) (3 * PTSIZE);
+
+	assert((pp = page_alloc(0)));
+	assert((pd = page_alloc(ALLOC_ZERO)));
+	pd->pp_ref++;
+	pgdir = page2kva(pd);
+	assert(page_insert(kern_pgdir, pp, va, PTE_W|PTE_U) == 0);
+	memset(va, 0x5a, PGSIZE);
+
+	// sharing copies the mapping, not the page
+	assert(page_share_cow(kern_pgdir, pgdir, (uintptr_t) va, PTSIZE) == 0);
+	assert(pp->pp_ref == 2);
+	ptep = pgdir_walk(kern_pgdir, va, 0);
+	assert((*ptep & (PTE_W|PTE_COW|PTE_U)) == (PTE_COW|PTE_U));
+	assert(PTE_ADDR(*pgdir_walk(pgdir, va, 0)) == page2pa(pp));
+	assert(*pgdir_walk(pgdir, va, 0) & PTE_COW);
+
+	// breaking a shared page copies it ...
+	assert(page_cow_break(kern_pgdir, va + 4) == 0);
+	ptep = pgdir_walk(kern_pgdir, va, 0);
+	assert(PTE_ADDR(*ptep) != page2pa(pp));
+	assert((*ptep & (PTE_W|PTE_COW)) == PTE_W);
+	assert(va[0] == 0x5a && va[PGSIZE - 1] == 0x5a);
+	assert(pp->pp_ref == 1);
+
+	// ... and breaking the last mapping just makes it writable
+	assert(page_cow_break(pgdir, va) == 0);
+	assert(PTE_ADDR(*pgdir_walk(pgdir, va, 0)) == page2pa(pp));
+	assert((*pgdir_walk(pgdir, va, 0) & (PTE_W|PTE_COW)) == PTE_W);
+	assert(pp->pp_ref == 1);
+	assert(page_cow_break(pgdir, va) == -E_FAULT);
+
+	page_remove(pgdir, va);
+	page_remove(kern_pgdir, va);
+	assert(pp->pp_ref == 0);
+	assert(!(pgdir[PDX(va)] & PTE_P) && !(kern_pgdir[PDX(va)] & PTE_P));
+	page_decref(pd);
+
+	CPRINTF_CACHED("check_page_cow() succeeded!\n");
+}
+
+// check batched page sharing and moving between page directories
+static void
+check_page_transfer(void)
+{
+	struct PageInfo *pp[3], *pd;
+	pde_t *pgdir;
+	pte_t pte;
+	char *va = (char *) (3 * PTSIZE), *va2 = (char *) (5 * PTSIZE);
+	int i;
+
+	assert((pd = page_alloc(ALLOC_ZERO)));
+	pd->pp_ref++;
+	pgdir = page2kva(pd);
+	for (i = 0; i < 3; i++) {
+		assert((pp[i] = page_alloc(0)));
+		assert(page_insert(kern_pgdir, pp[i], va + i * PGSIZE, PTE_W|PTE_U) == 0);
+	}
+
+	// a failed transfer leaves no destination page table behind
+	assert(page_transfer(kern_pgdir, (uintptr_t) va, pgdir, (uintptr_t) va2, 4, PTE_U, 0) == -E_INVAL);
+	assert(!(pgdir[PDX(va2)] & PTE_P));
+	assert(pp[0]->pp_ref == 1);
+
+	// share read-only
+	assert(page_transfer(kern_pgdir, (uintptr_t) va, pgdir, (uintptr_t) va2, 3, PTE_U, 0) == 0);
+	for (i = 0; i < 3; i++) {
+		pte = *pgdir_walk(pgdir, va2 + i * PGSIZE, 0);
+		assert(PTE_ADDR(pte) == page2pa(pp[i]));
+		assert((pte & (PTE_P|PTE_W|PTE_U)) == (PTE_P|PTE_U));
+		assert(pp[i]->pp_ref == 2);
+	}
+
+	// overlapping ranges in one pgdir and unmapped sources are refused
+	assert(page_transfer(kern_pgdir, (uintptr_t) va, kern_pgdir, (uintptr_t) va + PGSIZE, 2, PTE_U, 0) == -E_INVAL);
+	assert(page_transfer(kern_pgdir, (uintptr_t) va, pgdir, (uintptr_t) va2, 4, PTE_U, 0) == -E_INVAL);
+	assert(pp[0]->pp_ref == 2);
+
+	// move over the shared mappings, writable
+	assert(page_transfer(kern_pgdir, (uintptr_t) va, pgdir, (uintptr_t) va2, 3, PTE_W|PTE_U, XFER_MOVE) == 0);
+	for (i = 0; i < 3; i++) {
+		pte = *pgdir_walk(pgdir, va2 + i * PGSIZE, 0);
+		assert(PTE_ADDR(pte) == page2pa(pp[i]) && (pte & PTE_W));
+		assert(pp[i]->pp_ref == 1);
+	}
+	assert(!(kern_pgdir[PDX(va)] & PTE_P));
+
+	for (i = 0; i < 3; i++) {
+		page_remove(pgdir, va2 + i * PGSIZE);
+		assert(pp[i]->pp_ref == 0);
+	}
+	assert(!(pgdir[PDX(va2)] & PTE_P));
+	page_decref(pd);
+
+	CPRINTF_CACHED("check_page_transfer() succeeded!\n");
+}
+
+// check kmap, on a high page if the machine has any
+static void
+check_kmap(void)
+{
+	struct PageInfo *pp, *pp1;
+	uint32_t *va, *va1;
+
+	assert((pp = page_alloc(0)));
+	assert(page_zone(pp) != ZONE_HIGH);
+	assert(kmap(pp) == page2kva(pp));
+	kunmap(page2kva(pp));
+	page_free(pp);
+
+	assert((pp = page_alloc(ALLOC_HIGH | ALLOC_ZERO)));
+	assert((pp1 = page_alloc(ALLOC_HIGH)));
+	if (page_zone(pp) == ZONE_HIGH && page_zone(pp1) == ZONE_HIGH) {
+		va = kmap(pp);
+		assert((uintptr_t) va >= KMAPBASE && (uintptr_t) va < KMAPBASE + NKMAP * PGSIZE);
+		assert(va[0] == 0 && va[PGSIZE / 4 - 1] == 0);
+		assert(kmap(pp) == va);
+		va1 = kmap(pp1);
+		assert(va1 != va);
+		va[0] = 0x12345678;
+		va1[0] = 0x9abcdef0;
+		assert(check_va2pa(kern_pgdir, (uintptr_t) va) == page2pa(pp));
+		kunmap(va);
+		kunmap(va);
+		kunmap(va1);
+		// a released slot keeps its mapping
+		assert((va = kmap(pp)) && va[0] == 0x12345678);
+		kunmap(va);
+	}
+	page_free(pp);
+	page_free(pp1);
+
+	CPRINTF_CACHED("check_kmap() succeeded!\n");
 }
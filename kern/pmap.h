@@ -8,6 +8,7 @@
 
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 extern char bootstacktop[], bootstack[];
 
@@ -36,23 +37,59 @@ _paddr(const char *file, int line, void *kva)
  * virtual address.  It panics if you pass an invalid physical address. */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
 
+// Physical memory from DIRECTMAP_SIZE up (ZONE_HIGH) isn't mapped at
+// KERNBASE; the kernel reaches it through kmap.
+#define DIRECTMAP_SIZE	(0xFFFFFFFF - KERNBASE + 1)
+
 static inline void*
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (PGNUM(pa) >= npages || pa >= DIRECTMAP_SIZE)
 		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
 	return (void *)(pa + KERNBASE);
 }
 
 
+// Physical memory zones, each with its own free list.  page_alloc
+// takes pages from the highest zone the caller accepts and falls back
+// to lower ones, so scarce low memory is used last.
+enum {
+	ZONE_LOW = 0,		// [0, 1MB): real-mode and legacy devices
+	ZONE_DMA,		// [1MB, 16MB): reachable by ISA DMA
+	ZONE_NORMAL,		// [16MB, DIRECTMAP_SIZE)
+	ZONE_HIGH,		// [DIRECTMAP_SIZE, ...): only through kmap
+	NZONES
+};
+
+#define ZONE_DMA_START	EXTPHYSMEM
+#define ZONE_NORMAL_START 0x1000000
+
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// For page_alloc, only take pages below 16MB (ZONE_DMA or lower).
+	ALLOC_DMA = 1<<1,
+	// For page_alloc, only take pages below 1MB (ZONE_LOW).
+	ALLOC_LOW = 1<<2,
+	// For page_alloc, prefer ZONE_HIGH.  The caller must access the
+	// page through kmap, not page2kva.
+	ALLOC_HIGH = 1<<3,
+};
+
+enum {
+	// For page_transfer, unmap the pages from the source.
+	XFER_MOVE = 1<<0,
 };
 
+// Software PTE bit: the page is shared copy-on-write.  The PTE is
+// read-only, and a write fault makes page_cow_break give this mapping
+// its own writable copy.
+#define PTE_COW		0x200
+
 void	mem_init(void);
 
 void	page_init(void);
+bool	page_init_idle(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
@@ -60,7 +97,33 @@ void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
+void	*mmio_map_region(physaddr_t pa, size_t size);
+
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+
+int	page_share_cow(pde_t *src_pgdir, pde_t *dst_pgdir, uintptr_t va, size_t len);
+int	page_cow_break(pde_t *pgdir, void *va);
+int	page_transfer(pde_t *src_pgdir, uintptr_t srcva, pde_t *dst_pgdir,
+		      uintptr_t dstva, size_t n, int perm, int flags);
+
+void	page_meminfo(void);
+
+#ifdef PAGE_TRACK
+// Allocation-site tracking, enabled with 'make DEFS=-DPAGE_TRACK'.
+// page_alloc records the return addresses of its caller's stack in a
+// side table parallel to 'pages'; page_sites_report aggregates them.
+#ifndef PAGE_TRACK_DEPTH
+#define PAGE_TRACK_DEPTH	4	// Return addresses kept per page
+#endif
+#define PAGE_TRACK_NSITES	128	// Distinct sites page_sites_report counts
+
+struct PageSite {
+	uintptr_t ps_pcs[PAGE_TRACK_DEPTH];	// ps_pcs[0] is the call site
+};
+
+void	page_sites_report(int topn);
+#endif
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -82,6 +145,41 @@ page2kva(struct PageInfo *pp)
 	return KADDR(page2pa(pp));
 }
 
+static inline int
+page_zone(struct PageInfo *pp)
+{
+	physaddr_t pa = page2pa(pp);
+
+	if (pa < ZONE_DMA_START)
+		return ZONE_LOW;
+	if (pa < ZONE_NORMAL_START)
+		return ZONE_DMA;
+	return pa < DIRECTMAP_SIZE ? ZONE_NORMAL : ZONE_HIGH;
+}
+
+void	*kmap(struct PageInfo *pp);
+void	kunmap(void *kva);
+
+// pgdir_walk caches this many page table translations, in the slot
+// picked by the PDX's low bits (mixed with the pgdir).
+#define PTCACHE_SIZE	64		// Must be a power of 2
+
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
+void	ptcache_invalidate(pde_t *pgdir, const void *va);
+int	pte_set(pde_t *pgdir, const void *va, pte_t pte);
+
+// Return the PTE for 'va' in 'pgdir', or 0 if there is no page table
+// for 'va'.  When 'pgdir' is the loaded page directory this reads
+// uvpd and uvpt instead of walking the tables through KADDR.
+static inline pte_t
+pte_get(pde_t *pgdir, const void *va)
+{
+	pte_t *pte;
+
+	if (rcr3() == (physaddr_t) pgdir - KERNBASE)
+		return (uvpd[PDX(va)] & PTE_P) ? uvpt[PGNUM(va)] : 0;
+	pte = pgdir_walk(pgdir, va, 0);
+	return pte ? *pte : 0;
+}
 
 #endif /* !JOS_KERN_PMAP_H */
@@ -5,6 +5,12 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+#include <kern/spinlock.h>
+
+// Keeps the output of concurrent cprintfs from interleaving.
+static struct Spinlock print_lock = SPINLOCK_INIT("cprintf");
+
 
 static void
 putch(int ch, int *cnt)
@@ -13,12 +19,21 @@ putch(int ch, int *cnt)
 	*cnt++;
 }
 
+static void
+putspan(const char *s, size_t len, int *cnt)
+{
+	cputs(s, len);
+	*cnt += len;
+}
+
 int
 vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
 
+	cons_lock(&print_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	cons_unlock(&print_lock);
 	return cnt;
 }
 
@@ -35,3 +50,19 @@ cprintf(const char *fmt, ...)
 	return cnt;
 }
 
+// cprintf for a format pre-parsed by CPRINTF_CACHED (see inc/stdio.h).
+int
+cprintf_cached(struct Fmtcache *fc, ...)
+{
+	va_list ap;
+	int cnt = 0;
+
+	va_start(ap, fc);
+	cons_lock(&print_lock);
+	vprintfmt_cached((void*)putch, (void*)putspan, &cnt, fc, ap);
+	cons_unlock(&print_lock);
+	va_end(ap);
+
+	return cnt;
+}
+
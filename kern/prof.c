@@ -0,0 +1,202 @@
+// Statistical kernel profiler.
+//
+// While running, every timer interrupt records the interrupted EIP in a
+// histogram and, space permitting, the frame-pointer call stack beneath
+// it.  prof_report() symbolizes the histogram per function;
+// prof_dump_stacks() prints the stacks for kern/prof2folded.pl.
+// Each CPU samples into its own buffer; the reports merge them.  The
+// buffers are mapped at PROFBASE the first time the profiler starts,
+// one per CPU present, so they take no room under KERNBASE+4MB, where
+// boot_alloc needs it for pages[].
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/trap.h>
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/prof.h>
+#include <kern/kdebug.h>
+#include <kern/kclock.h>
+#include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+
+#define PROFBUF_SIZE	ROUNDUP(sizeof(struct ProfBuf), PGSIZE)
+
+static struct ProfBuf *prof_buf[NCPU];	// NULL until mapped
+static bool prof_running;
+
+// Map a buffer for each CPU that doesn't have one yet.
+static int
+prof_alloc(void)
+{
+	struct PageInfo *pp;
+	uintptr_t base, va;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		if (prof_buf[i])
+			continue;
+		base = PROFBASE + i * PROFBUF_SIZE;
+		// Stay clear of the kernel stacks and their guards.
+		assert(base + PROFBUF_SIZE <= KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP));
+		for (va = base; va < base + PROFBUF_SIZE; va += PGSIZE) {
+			if (!(pp = page_alloc(0)))
+				return -E_NO_MEM;
+			if (page_insert(kern_pgdir, pp, (void *) va, PTE_W) < 0) {
+				page_free(pp);
+				return -E_NO_MEM;
+			}
+		}
+		prof_buf[i] = (struct ProfBuf *) base;
+	}
+	return 0;
+}
+
+int
+prof_start(unsigned hz)
+{
+	int i, r;
+
+	if ((r = prof_alloc()) < 0)
+		return r;
+	for (i = 0; i < ncpu; i++)
+		memset(prof_buf[i], 0, sizeof(struct ProfBuf));
+	kclock_init(hz);
+	prof_running = 1;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << IRQ_TIMER));
+	sti();
+	return 0;
+}
+
+void
+prof_stop(void)
+{
+	irq_setmask_8259A(irq_mask_8259A | (1 << IRQ_TIMER));
+	prof_running = 0;
+}
+
+// Record one sample.  Called from trap_dispatch on each timer interrupt,
+// with interrupts disabled.
+void
+prof_tick(struct Trapframe *tf)
+{
+	struct ProfBuf *pb = prof_buf[cpunum()];
+	uint32_t h, i;
+	uintptr_t *pcs;
+
+	if (!prof_running || !pb)
+		return;
+	pb->nsamples++;
+
+	// Linear probing from a hash of the EIP.
+	h = (tf->tf_eip >> 2) * 2654435761U;
+	for (i = 0; i < PROF_HASHSIZE; i++) {
+		h &= PROF_HASHSIZE - 1;
+		if (pb->hist[h].eip == tf->tf_eip || pb->hist[h].count == 0)
+			break;
+		h++;
+	}
+	if (i == PROF_HASHSIZE)
+		pb->ndropped++;
+	else {
+		pb->hist[h].eip = tf->tf_eip;
+		pb->hist[h].count++;
+	}
+
+	if (pb->nstacks == PROF_NSTACKS)
+		return;
+	pcs = pb->stacks[pb->nstacks].pcs;
+	pcs[0] = tf->tf_eip;
+	pb->stacks[pb->nstacks++].depth = 1 +
+		backtrace_capture_ebp(tf->tf_regs.reg_ebp, pcs + 1,
+				      PROF_MAXDEPTH - 1);
+}
+
+// Print the 'topn' functions with the most samples.
+void
+prof_report(int topn)
+{
+	static struct {
+		uintptr_t fn_addr;
+		const char *name;
+		int namelen;
+		uint32_t count;
+	} fns[PROF_HASHSIZE + 1];	// last slot is swap space
+	struct ProfBuf *pb;
+	struct Eipdebuginfo info;
+	uint32_t nsamples = 0, ndropped = 0;
+	int nfns = 0, c, i, j, best;
+
+	for (c = 0; c < ncpu; c++) {
+		if (!(pb = prof_buf[c]))
+			continue;
+		nsamples += pb->nsamples;
+		ndropped += pb->ndropped;
+		for (i = 0; i < PROF_HASHSIZE; i++) {
+			if (pb->hist[i].count == 0)
+				continue;
+			if (ksym_lookup(pb->hist[i].eip, &info) < 0)
+				debuginfo_eip(pb->hist[i].eip, &info);
+			for (j = 0; j < nfns && fns[j].fn_addr != info.eip_fn_addr; j++)
+				/* do nothing */;
+			if (j == nfns) {
+				// Out of room; count it as dropped.
+				if (nfns == PROF_HASHSIZE) {
+					ndropped += pb->hist[i].count;
+					continue;
+				}
+				fns[j].fn_addr = info.eip_fn_addr;
+				fns[j].name = info.eip_fn_name;
+				fns[j].namelen = info.eip_fn_namelen;
+				fns[j].count = 0;
+				nfns++;
+			}
+			fns[j].count += pb->hist[i].count;
+		}
+	}
+
+	cprintf("prof: %u samples, %u dropped%s\n", nsamples,
+		ndropped, prof_running ? " (running)" : "");
+	if (nsamples == 0)
+		return;
+	cprintf("  samples    %%  function\n");
+	// Selection sort; topn is small.
+	for (i = 0; i < topn && i < nfns; i++) {
+		for (best = j = i; j < nfns; j++)
+			if (fns[j].count > fns[best].count)
+				best = j;
+		if (best != i) {
+			fns[nfns] = fns[i];
+			fns[i] = fns[best];
+			fns[best] = fns[nfns];
+		}
+		cprintf("  %7u  %3u  %.*s\n", fns[i].count,
+			fns[i].count * 100 / nsamples,
+			fns[i].namelen, fns[i].name);
+	}
+}
+
+// Print each recorded stack, innermost PC first, one per line:
+//	prof-stack: <pc> <return address> ...
+void
+prof_dump_stacks(void)
+{
+	struct ProfBuf *pb;
+	uint32_t i, d;
+	int c;
+
+	for (c = 0; c < ncpu; c++) {
+		if (!(pb = prof_buf[c]))
+			continue;
+		for (i = 0; i < pb->nstacks; i++) {
+			cprintf("prof-stack:");
+			for (d = 0; d < pb->stacks[i].depth; d++)
+				cprintf(" %08x", pb->stacks[i].pcs[d]);
+			cprintf("\n");
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef JOS_KERN_PROF_H
+#define JOS_KERN_PROF_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Trapframe;
+
+#define PROF_HZ		1000	// default sampling rate
+#define PROF_HASHSIZE	1024	// distinct EIPs per histogram (power of 2)
+#define PROF_NSTACKS	512	// stack samples kept per buffer
+#define PROF_MAXDEPTH	16	// return addresses kept per stack sample
+
+// Sample buffer filled by the timer interrupt.  There is one per CPU,
+// though only the boot CPU takes the PIT interrupt so far.
+struct ProfBuf {
+	uint32_t nsamples;		// timer ticks sampled
+	uint32_t ndropped;		// ticks whose EIP didn't fit in hist
+	struct {
+		uintptr_t eip;
+		uint32_t count;
+	} hist[PROF_HASHSIZE];		// open-addressed EIP -> count
+	uint32_t nstacks;
+	struct {
+		uint32_t depth;		// pcs[0] is the interrupted EIP
+		uintptr_t pcs[PROF_MAXDEPTH];
+	} stacks[PROF_NSTACKS];
+};
+
+int prof_start(unsigned hz);
+void prof_stop(void);
+void prof_tick(struct Trapframe *tf);
+void prof_report(int topn);
+void prof_dump_stacks(void);
+
+#endif	// !JOS_KERN_PROF_H
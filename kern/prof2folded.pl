@@ -0,0 +1,47 @@
+#!/usr/bin/perl
+#
+# Usage: perl kern/prof2folded.pl obj/kern/kernel.sym < jos.out > prof.folded
+#
+# Turns the 'prof-stack:' lines printed by the kernel monitor's
+# 'prof dump' command into folded stacks ("outer;...;inner count"),
+# the input format of flamegraph.pl and similar tools.  Addresses are
+# symbolized with the 'nm -n' listing the build leaves in kernel.sym.
+
+open(SYM, $ARGV[0]) || die "open $ARGV[0]: $!";
+my (@addr, @name);
+while (<SYM>) {
+	if (/^([0-9a-f]{8}) [tTwW] (\S+)$/) {
+		push @addr, hex($1);
+		push @name, $2;
+	}
+}
+close SYM;
+
+# Name of the function containing $pc (last symbol at or below it).
+sub symbolize {
+	my $pc = shift;
+	my ($l, $r) = (0, $#addr);
+	return sprintf("0x%08x", $pc) if $r < 0 || $pc < $addr[0];
+	while ($l < $r) {
+		my $m = int(($l + $r + 1) / 2);
+		if ($addr[$m] <= $pc) {
+			$l = $m;
+		} else {
+			$r = $m - 1;
+		}
+	}
+	return $name[$l];
+}
+
+my %count;
+while (<STDIN>) {
+	next unless /^prof-stack:((?: [0-9a-f]{8})+)\s*$/;
+	my @pcs = map { hex($_) } split(' ', $1);
+	# Return addresses point just past the call; back up into it.
+	my @fns = (symbolize(shift @pcs), map { symbolize($_ - 1) } @pcs);
+	$count{join(';', reverse @fns)}++;
+}
+
+foreach my $stack (sort keys %count) {
+	print "$stack $count{$stack}\n";
+}
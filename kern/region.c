@@ -0,0 +1,203 @@
+// Demand-zero regions.
+//
+// region_reserve only records a range of virtual addresses; no memory
+// is allocated until page_fault_handler finds a not-present fault
+// inside the range and calls region_fault, which maps zeroed pages
+// there.  With fault-around, one fault maps the surrounding aligned
+// group of pages so a sequential scan takes fewer faults.
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+
+#include <kern/pmap.h>
+#include <kern/region.h>
+#include <kern/kmem.h>
+#include <kern/spinlock.h>
+
+static struct KmemCache *region_cache;
+static struct Region *regions;		// Active regions
+// Protects regions; faults only read it.
+static struct RwLock region_lock = RWLOCK_INIT("regions");
+
+static void check_region(void);
+
+void
+region_init(void)
+{
+	if (!(region_cache = kmem_cache_create("region", sizeof(struct Region), 0)))
+		panic("region_init: no memory for the region cache");
+
+	check_region();
+}
+
+static struct Region *
+region_find(pde_t *pgdir, uintptr_t va)
+{
+	struct Region *r;
+
+	for (r = regions; r; r = r->r_link)
+		if (r->r_pgdir == pgdir && va >= r->r_start && va < r->r_end)
+			return r;
+	return NULL;
+}
+
+//
+// Reserve [va, va+len) in 'pgdir' as a demand-zero region whose pages
+// will be mapped with 'perm' | PTE_P.  Each fault maps the aligned group
+// of 'faultaround' pages around the faulting page (1 maps just the page
+// itself); 'faultaround' must be a power of 2 up to REGION_MAXAROUND.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if the range is misaligned, reaches above UTOP or overlaps
+//	another region, or perm or faultaround is invalid
+//   -E_NO_MEM, if there is no memory for the region descriptor
+//
+int
+region_reserve(pde_t *pgdir, uintptr_t va, size_t len, int perm,
+	       int faultaround)
+{
+	struct Region *r, *o;
+
+	if (va % PGSIZE || len % PGSIZE || len == 0 || va + len < va
+	    || va + len > UTOP || (perm & ~PTE_SYSCALL)
+	    || faultaround < 1 || faultaround > REGION_MAXAROUND
+	    || (faultaround & (faultaround - 1)))
+		return -E_INVAL;
+	if (!(r = kmem_cache_alloc(region_cache)))
+		return -E_NO_MEM;
+	r->r_pgdir = pgdir;
+	r->r_start = va;
+	r->r_end = va + len;
+	r->r_perm = perm | PTE_P;
+	r->r_faultaround = faultaround;
+
+	rw_wrlock(&region_lock);
+	for (o = regions; o; o = o->r_link)
+		if (o->r_pgdir == pgdir && va < o->r_end
+		    && va + len > o->r_start) {
+			rw_wrunlock(&region_lock);
+			kmem_cache_free(region_cache, r);
+			return -E_INVAL;
+		}
+	r->r_link = regions;
+	regions = r;
+	rw_wrunlock(&region_lock);
+	return 0;
+}
+
+//
+// Unmap every page of the region starting at 'va' in 'pgdir' and free
+// its descriptor.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if no region starts at 'va'
+//
+int
+region_release(pde_t *pgdir, uintptr_t va)
+{
+	struct Region **rp, *r;
+	uintptr_t a;
+
+	rw_wrlock(&region_lock);
+	for (rp = &regions; (r = *rp); rp = &r->r_link)
+		if (r->r_pgdir == pgdir && r->r_start == va)
+			break;
+	if (r)
+		*rp = r->r_link;
+	rw_wrunlock(&region_lock);
+	if (!r)
+		return -E_INVAL;
+
+	for (a = r->r_start; a < r->r_end; a += PGSIZE)
+		page_remove(pgdir, (void *) a);
+	kmem_cache_free(region_cache, r);
+	return 0;
+}
+
+//
+// Handle a not-present fault at 'va' in 'pgdir': if 'va' lies in a
+// region, map zeroed pages at it and, for fault-around, at the
+// still-unmapped pages of its aligned group.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT, if 'va' isn't in a region
+//   -E_NO_MEM, if there was no memory for the faulting page
+//
+int
+region_fault(pde_t *pgdir, uintptr_t va)
+{
+	struct Region *r;
+	struct PageInfo *pp;
+	uintptr_t a, start, end;
+	int err, perm;
+
+	rw_rdlock(&region_lock);
+	if (!(r = region_find(pgdir, va))) {
+		rw_rdunlock(&region_lock);
+		return -E_FAULT;
+	}
+	va = ROUNDDOWN(va, PGSIZE);
+	start = MAX(ROUNDDOWN(va, r->r_faultaround * PGSIZE), r->r_start);
+	end = MIN(start + r->r_faultaround * PGSIZE, r->r_end);
+	// Copy what the loop needs, so the lock isn't held across
+	// page_alloc and page_insert.
+	perm = r->r_perm;
+	rw_rdunlock(&region_lock);
+
+	for (a = start; a < end; a += PGSIZE) {
+		if (a != va && (pte_get(pgdir, (void *) a) & PTE_P))
+			continue;
+		// The neighbours are only a prefetch; give up on them
+		// quietly when memory is short.
+		if (!(pp = page_alloc(ALLOC_ZERO | ALLOC_HIGH))) {
+			if (a == va)
+				return -E_NO_MEM;
+			continue;
+		}
+		if ((err = page_insert(pgdir, pp, (void *) a, perm)) < 0) {
+			page_free(pp);
+			if (a == va)
+				return err;
+		}
+	}
+	return 0;
+}
+
+// Check demand-zero faults through the real page fault path.
+static void
+check_region(void)
+{
+	volatile char *va = (volatile char *) (3 * PTSIZE);
+	int i;
+
+	assert(region_reserve(kern_pgdir, (uintptr_t) va, 16 * PGSIZE,
+			      PTE_W, 4) == 0);
+	assert(region_reserve(kern_pgdir, (uintptr_t) va + 15 * PGSIZE,
+			      PGSIZE, PTE_W, 1) == -E_INVAL);
+	assert(region_reserve(kern_pgdir, (uintptr_t) va, PGSIZE,
+			      PTE_W, 3) == -E_INVAL);
+	for (i = 0; i < 16; i++)
+		assert(!(pte_get(kern_pgdir, (void *) (va + i * PGSIZE)) & PTE_P));
+
+	// touching page 5 maps the group 4..7, zeroed
+	assert(va[5 * PGSIZE + 10] == 0);
+	for (i = 0; i < 16; i++)
+		assert(!(pte_get(kern_pgdir, (void *) (va + i * PGSIZE)) & PTE_P)
+		       == (i < 4 || i > 7));
+	va[7 * PGSIZE] = 1;
+	assert(va[7 * PGSIZE] == 1 && va[6 * PGSIZE] == 0);
+
+	// outside any region there is nothing to fault in
+	assert(region_fault(kern_pgdir, (uintptr_t) va + 16 * PGSIZE) == -E_FAULT);
+
+	assert(region_release(kern_pgdir, (uintptr_t) va) == 0);
+	assert(!(kern_pgdir[PDX(va)] & PTE_P));
+	assert(region_release(kern_pgdir, (uintptr_t) va) == -E_INVAL);
+
+	CPRINTF_CACHED("check_region() succeeded!\n");
+}
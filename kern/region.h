@@ -0,0 +1,30 @@
+#ifndef JOS_KERN_REGION_H
+#define JOS_KERN_REGION_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+#define REGION_MAXAROUND NPTENTRIES	// limit on r_faultaround
+
+// A reserved, demand-zero range of virtual addresses.  Pages in
+// [r_start, r_end) are allocated, zeroed and mapped with r_perm the
+// first time they are touched.
+struct Region {
+	pde_t *r_pgdir;			// Address space the range belongs to
+	uintptr_t r_start;		// First address, page-aligned
+	uintptr_t r_end;		// End address, page-aligned
+	int r_perm;			// PTE permissions for the pages
+	int r_faultaround;		// Pages mapped per fault (power of 2)
+	struct Region *r_link;		// Next active region
+};
+
+void	region_init(void);
+int	region_reserve(pde_t *pgdir, uintptr_t va, size_t len, int perm,
+		       int faultaround);
+int	region_release(pde_t *pgdir, uintptr_t va);
+int	region_fault(pde_t *pgdir, uintptr_t va);
+
+#endif	// !JOS_KERN_REGION_H
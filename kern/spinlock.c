@@ -0,0 +1,388 @@
+// Ticket, MCS and reader-writer spinlocks, with optional contention
+// statistics (see kern/spinlock.h).
+//
+// x86 keeps stores in order and never moves a load ahead of an older
+// load, so taking a lock needs an atomic instruction but releasing one
+// is a plain store behind a compiler barrier.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/stdio.h>
+
+#include <kern/spinlock.h>
+
+// Keep the compiler from moving memory accesses across this point.
+#define barrier()	asm volatile("" ::: "memory")
+
+#ifdef LOCK_STATS
+static struct LockStats *volatile lock_list;	// Locks taken so far
+
+static uint64_t
+stat_now(void)
+{
+	return read_tsc();
+}
+
+// Put 'ls' on lock_list the first time its lock is taken.  Locks are
+// never unlisted, so pushing with cmpxchg is enough.
+static void
+stats_register(struct LockStats *ls, const char *kind, const char *name)
+{
+	struct LockStats *head;
+
+	if (ls->ls_listed || xchg(&ls->ls_listed, 1))
+		return;
+	ls->ls_kind = kind;
+	ls->ls_name = name;
+	do {
+		head = lock_list;
+		ls->ls_next = head;
+	} while (cmpxchg((volatile uint32_t *) &lock_list, (uint32_t) head,
+			 (uint32_t) ls) != (uint32_t) head);
+}
+
+// The lock was just taken, after waiting since 'start' if 'waited'.
+static void
+stats_acquired(struct LockStats *ls, const char *kind, const char *name,
+	       uint64_t start, bool waited)
+{
+	struct LockCpuStats *s = &ls->ls_cpu[cpunum()];
+	uint64_t now = read_tsc();
+
+	stats_register(ls, kind, name);
+	s->acquires++;
+	if (waited) {
+		s->contended++;
+		s->spin += now - start;
+	}
+	s->hold_start = now;
+}
+
+// The lock is about to be released.
+static void
+stats_release(struct LockStats *ls)
+{
+	struct LockCpuStats *s = &ls->ls_cpu[cpunum()];
+	uint64_t held = read_tsc() - s->hold_start;
+
+	if (held > s->max_hold)
+		s->max_hold = held;
+}
+
+#define STATS_ACQUIRED(lk, kind, start, waited) \
+	stats_acquired(&(lk)->stats, kind, (lk)->name, start, waited)
+#define STATS_RELEASE(lk)	stats_release(&(lk)->stats)
+#else
+static uint64_t
+stat_now(void)
+{
+	return 0;
+}
+
+#define STATS_ACQUIRED(lk, kind, start, waited)	do { } while (0)
+#define STATS_RELEASE(lk)			do { } while (0)
+#endif
+
+
+void
+push_cli(void)
+{
+	uint32_t eflags = read_eflags();
+
+	cli();
+	if (thiscpu->cpu_ncli++ == 0)
+		thiscpu->cpu_intena = eflags & FL_IF;
+}
+
+void
+pop_cli(void)
+{
+	if (read_eflags() & FL_IF)
+		panic("pop_cli: interruptible");
+	if (--thiscpu->cpu_ncli < 0)
+		panic("pop_cli: unbalanced");
+	if (thiscpu->cpu_ncli == 0 && thiscpu->cpu_intena)
+		sti();
+}
+
+
+/***** Ticket locks *****/
+
+void
+spin_init(struct Spinlock *lk, const char *name)
+{
+	memset(lk, 0, sizeof(*lk));
+	lk->name = name;
+}
+
+// Check whether this CPU is holding the lock.
+// Call with interrupts off, so the answer can't change.
+bool
+spin_holding(struct Spinlock *lk)
+{
+	return lk->owner != lk->next && lk->cpu == thiscpu;
+}
+
+void
+spin_lock(struct Spinlock *lk)
+{
+	uint32_t ticket;
+	uint64_t start = 0;
+	bool waited;
+
+	push_cli();
+	if (spin_holding(lk))
+		panic("spin_lock: CPU %d already holds %s", cpunum(), lk->name);
+
+	ticket = xadd(&lk->next, 1);
+	if ((waited = lk->owner != ticket)) {
+		start = stat_now();
+		while (lk->owner != ticket)
+			pause();
+	}
+	lk->cpu = thiscpu;
+	STATS_ACQUIRED(lk, "spin", start, waited);
+}
+
+void
+spin_unlock(struct Spinlock *lk)
+{
+	if (!spin_holding(lk))
+		panic("spin_unlock: CPU %d doesn't hold %s", cpunum(), lk->name);
+
+	STATS_RELEASE(lk);
+	lk->cpu = NULL;
+	barrier();
+	// Only the holder writes owner, so this needn't be atomic.
+	lk->owner = lk->owner + 1;
+	pop_cli();
+}
+
+
+/***** MCS queue locks *****/
+
+void
+mcs_init(struct McsLock *lk, const char *name)
+{
+	memset(lk, 0, sizeof(*lk));
+	lk->name = name;
+}
+
+// Check whether this CPU is holding the lock.
+// Call with interrupts off, so the answer can't change.
+bool
+mcs_holding(struct McsLock *lk)
+{
+	return lk->tail && lk->cpu == thiscpu;
+}
+
+void
+mcs_lock(struct McsLock *lk, struct McsNode *me)
+{
+	struct McsNode *pred;
+	uint64_t start = 0;
+
+	push_cli();
+	if (mcs_holding(lk))
+		panic("mcs_lock: CPU %d already holds %s", cpunum(), lk->name);
+
+	me->next = NULL;
+	me->locked = 1;
+	pred = (struct McsNode *) xchg((volatile uint32_t *) &lk->tail,
+				       (uint32_t) me);
+	if (pred) {
+		// Queue behind pred and wait for it to hand over.
+		start = stat_now();
+		pred->next = me;
+		while (me->locked)
+			pause();
+	}
+	lk->cpu = thiscpu;
+	STATS_ACQUIRED(lk, "mcs", start, pred != NULL);
+}
+
+void
+mcs_unlock(struct McsLock *lk, struct McsNode *me)
+{
+	if (!mcs_holding(lk))
+		panic("mcs_unlock: CPU %d doesn't hold %s", cpunum(), lk->name);
+
+	STATS_RELEASE(lk);
+	lk->cpu = NULL;
+	barrier();
+	if (!me->next) {
+		// No one queued behind us yet: free the lock, unless a
+		// waiter has swapped itself into tail and is about to
+		// link in.
+		if (cmpxchg((volatile uint32_t *) &lk->tail, (uint32_t) me, 0)
+		    == (uint32_t) me) {
+			pop_cli();
+			return;
+		}
+		while (!me->next)
+			pause();
+	}
+	me->next->locked = 0;
+	pop_cli();
+}
+
+
+/***** Reader-writer locks *****/
+
+void
+rw_init(struct RwLock *lk, const char *name)
+{
+	memset(lk, 0, sizeof(*lk));
+	lk->name = name;
+}
+
+// Take the lock for reading.  Read locks don't nest: a waiting writer
+// would block the inner one forever.
+void
+rw_rdlock(struct RwLock *lk)
+{
+	uint32_t s;
+	uint64_t start = 0;
+	bool waited = 0;
+
+	push_cli();
+	if (lk->cpu == thiscpu)
+		panic("rw_rdlock: CPU %d holds %s for writing", cpunum(), lk->name);
+
+	for (;;) {
+		s = lk->state;
+		if (!(s & (RW_WRITER | RW_WAITING))) {
+			// Only another reader got in between; retry.
+			if (cmpxchg(&lk->state, s, s + 1) == s)
+				break;
+			continue;
+		}
+		if (!waited) {
+			waited = 1;
+			start = stat_now();
+		}
+		pause();
+	}
+	STATS_ACQUIRED(lk, "rw", start, waited);
+}
+
+void
+rw_rdunlock(struct RwLock *lk)
+{
+	if (!(lk->state & ~(RW_WRITER | RW_WAITING)))
+		panic("rw_rdunlock: %s isn't held for reading", lk->name);
+
+	STATS_RELEASE(lk);
+	xadd(&lk->state, -1);
+	pop_cli();
+}
+
+// Take the lock for writing.  While this waits for readers to leave,
+// RW_WAITING keeps new ones out.
+void
+rw_wrlock(struct RwLock *lk)
+{
+	uint32_t s;
+	uint64_t start = 0;
+	bool waited = 0;
+
+	push_cli();
+	if (lk->cpu == thiscpu)
+		panic("rw_wrlock: CPU %d already holds %s", cpunum(), lk->name);
+
+	for (;;) {
+		s = lk->state;
+		if ((s & ~RW_WAITING) == 0) {
+			if (cmpxchg(&lk->state, s, RW_WRITER) == s)
+				break;
+			continue;
+		}
+		// Another writer may have cleared RW_WAITING by taking the
+		// lock; set it again.
+		if (!(s & RW_WAITING))
+			cmpxchg(&lk->state, s, s | RW_WAITING);
+		if (!waited) {
+			waited = 1;
+			start = stat_now();
+		}
+		pause();
+	}
+	lk->cpu = thiscpu;
+	STATS_ACQUIRED(lk, "rw", start, waited);
+}
+
+void
+rw_wrunlock(struct RwLock *lk)
+{
+	if (!(lk->state & RW_WRITER) || lk->cpu != thiscpu)
+		panic("rw_wrunlock: CPU %d doesn't hold %s", cpunum(), lk->name);
+
+	STATS_RELEASE(lk);
+	lk->cpu = NULL;
+	barrier();
+	// Waiting writers may set RW_WAITING meanwhile, so keep it.
+	xadd(&lk->state, -RW_WRITER);
+	pop_cli();
+}
+
+
+#ifdef LOCK_STATS
+#define LOCK_REPORT_MAX	64	// Most locks lock_report sorts
+
+// Print the statistics of every lock taken so far, the ones that
+// spent the most time waiting first.
+void
+lock_report(void)
+{
+	static struct LockCpuStats sums[LOCK_REPORT_MAX];
+	static struct LockStats *locks[LOCK_REPORT_MAX];
+	struct LockCpuStats sum, *s;
+	struct LockStats *ls;
+	int i, j, n;
+
+	// Copy the sums first: printing takes the console locks and
+	// would change their numbers halfway.
+	n = 0;
+	for (ls = lock_list; ls && n < LOCK_REPORT_MAX; ls = ls->ls_next) {
+		memset(&sum, 0, sizeof(sum));
+		for (i = 0; i < NCPU; i++) {
+			s = &ls->ls_cpu[i];
+			sum.acquires += s->acquires;
+			sum.contended += s->contended;
+			sum.spin += s->spin;
+			sum.max_hold = MAX(sum.max_hold, s->max_hold);
+		}
+		// Insertion sort by spin time.
+		for (j = n++; j > 0 && sums[j - 1].spin < sum.spin; j--) {
+			sums[j] = sums[j - 1];
+			locks[j] = locks[j - 1];
+		}
+		sums[j] = sum;
+		locks[j] = ls;
+	}
+
+	cprintf("lock                kind   acquires  contended      spin-tsc  max-hold-tsc\n");
+	for (i = 0; i < n; i++)
+		cprintf("%-20s %-4s %10llu %10llu %13llu %13llu\n",
+			locks[i]->ls_name, locks[i]->ls_kind, sums[i].acquires,
+			sums[i].contended, sums[i].spin, sums[i].max_hold);
+}
+
+// Zero the statistics of every lock.
+void
+lock_reset(void)
+{
+	struct LockStats *ls;
+	struct LockCpuStats *s;
+	int i;
+
+	for (ls = lock_list; ls; ls = ls->ls_next)
+		for (i = 0; i < NCPU; i++) {
+			// Leave hold_start alone; the lock may be held.
+			s = &ls->ls_cpu[i];
+			s->acquires = s->contended = s->spin = s->max_hold = 0;
+		}
+}
+#endif
@@ -0,0 +1,108 @@
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+
+// Kernel locks.  All of them spin, and all of them disable interrupts
+// on the holding CPU (see push_cli), so a lock may be shared with
+// interrupt handlers.
+//
+//   struct Spinlock	ticket lock: FIFO, one cache line everyone spins on
+//   struct McsLock	MCS queue lock: FIFO, each waiter spins on its own
+//			McsNode, so a contended handoff touches one line
+//   struct RwLock	reader-writer lock; a waiting writer holds off
+//			new readers
+
+#ifdef LOCK_STATS
+// Contention statistics, enabled with 'make DEFS=-DLOCK_STATS'.  Each
+// CPU counts into its own slot, so counting adds no shared writes;
+// lock_report sums the slots.  Times are in TSC ticks.
+struct LockCpuStats {
+	uint64_t acquires;		// Acquisitions
+	uint64_t contended;		// Acquisitions that had to wait
+	uint64_t spin;			// Ticks spent waiting
+	uint64_t max_hold;		// Longest time held
+	uint64_t hold_start;		// private: when this CPU took the lock
+};
+
+struct LockStats {
+	struct LockCpuStats ls_cpu[NCPU];
+	const char *ls_kind;
+	const char *ls_name;
+	volatile uint32_t ls_listed;	// On the list lock_report walks
+	struct LockStats *ls_next;
+};
+
+void	lock_report(void);
+void	lock_reset(void);
+#endif
+
+struct Spinlock {
+	volatile uint32_t next;		// Ticket of the next CPU to arrive
+	volatile uint32_t owner;	// Ticket now allowed in
+	struct CpuInfo *cpu;		// The CPU holding the lock
+	const char *name;
+#ifdef LOCK_STATS
+	struct LockStats stats;
+#endif
+};
+
+// A waiter's place in an McsLock's queue.  It must stay put from
+// mcs_lock to mcs_unlock; a local variable of the caller does.
+struct McsNode {
+	struct McsNode *volatile next;	// Next waiter in the queue
+	volatile uint32_t locked;	// Cleared by the previous holder
+};
+
+struct McsLock {
+	struct McsNode *volatile tail;	// Last waiter, or NULL if free
+	struct CpuInfo *cpu;		// The CPU holding the lock
+	const char *name;
+#ifdef LOCK_STATS
+	struct LockStats stats;
+#endif
+};
+
+struct RwLock {
+	volatile uint32_t state;	// RW_WRITER, RW_WAITING, reader count
+	struct CpuInfo *cpu;		// The CPU holding it for writing
+	const char *name;
+#ifdef LOCK_STATS
+	struct LockStats stats;
+#endif
+};
+
+#define RW_WRITER	0x80000000	// Held for writing
+#define RW_WAITING	0x40000000	// A writer is waiting
+
+// Static initializers; or call the *_init functions.
+#define SPINLOCK_INIT(nm)	{ .name = (nm) }
+#define MCSLOCK_INIT(nm)	{ .name = (nm) }
+#define RWLOCK_INIT(nm)		{ .name = (nm) }
+
+void	spin_init(struct Spinlock *lk, const char *name);
+void	spin_lock(struct Spinlock *lk);
+void	spin_unlock(struct Spinlock *lk);
+bool	spin_holding(struct Spinlock *lk);
+
+void	mcs_init(struct McsLock *lk, const char *name);
+void	mcs_lock(struct McsLock *lk, struct McsNode *me);
+void	mcs_unlock(struct McsLock *lk, struct McsNode *me);
+bool	mcs_holding(struct McsLock *lk);
+
+void	rw_init(struct RwLock *lk, const char *name);
+void	rw_rdlock(struct RwLock *lk);
+void	rw_rdunlock(struct RwLock *lk);
+void	rw_wrlock(struct RwLock *lk);
+void	rw_wrunlock(struct RwLock *lk);
+
+// Nestable cli/sti: interrupts come back on at the outermost pop_cli,
+// and only if they were on at the outermost push_cli.
+void	push_cli(void);
+void	pop_cli(void);
+
+#endif	// !JOS_KERN_SPINLOCK_H
@@ -0,0 +1,291 @@
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/trap.h>
+#include <kern/console.h>
+#include <kern/monitor.h>
+#include <kern/picirq.h>
+#include <kern/prof.h>
+#include <kern/region.h>
+#include <kern/cpu.h>
+
+// Global descriptor table.
+//
+// Set up global descriptor table (GDT) with separate segments for
+// kernel mode and user mode.  Segments serve many purposes on the x86.
+// We don't use any of their memory-mapping capabilities, but we need
+// them to switch privilege levels.
+//
+// The kernel and user segments are identical except for the DPL.
+// To load the SS register, the CPL must equal the DPL.  Thus,
+// we must duplicate the segments for the user and the kernel.
+//
+// The boot loader's GDT lives in low memory that page_init hands out,
+// so the kernel must load its own before taking any interrupt.
+struct Segdesc gdt[] =
+{
+	// 0x0 - unused (always faults -- for trapping NULL far pointers)
+	SEG_NULL,
+
+	// 0x8 - kernel code segment
+	[GD_KT >> 3] = SEG(STA_X | STA_R, 0x0, 0xffffffff, 0),
+
+	// 0x10 - kernel data segment
+	[GD_KD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 0),
+
+	// 0x18 - user code segment
+	[GD_UT >> 3] = SEG(STA_X | STA_R, 0x0, 0xffffffff, 3),
+
+	// 0x20 - user data segment
+	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
+
+	// Per-CPU TSS descriptors (starting from GD_TSS0) and per-CPU data
+	// segments (starting from GD_CPU0) are initialized in
+	// trap_init_percpu()
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	[(GD_CPU0 >> 3) + NCPU - 1] = SEG_NULL
+};
+
+struct Pseudodesc gdt_pd = {
+	sizeof(gdt) - 1, (unsigned long) gdt
+};
+
+/* Interrupt descriptor table.  (Must be built at run time because
+ * shifted function addresses can't be represented in relocation records.)
+ */
+struct Gatedesc idt[256] = { { 0 } };
+struct Pseudodesc idt_pd = {
+	sizeof(idt) - 1, (uint32_t) idt
+};
+
+
+static const char *trapname(int trapno)
+{
+	static const char * const excnames[] = {
+		"Divide error",
+		"Debug",
+		"Non-Maskable Interrupt",
+		"Breakpoint",
+		"Overflow",
+		"BOUND Range Exceeded",
+		"Invalid Opcode",
+		"Device Not Available",
+		"Double Fault",
+		"Coprocessor Segment Overrun",
+		"Invalid TSS",
+		"Segment Not Present",
+		"Stack Fault",
+		"General Protection",
+		"Page Fault",
+		"(unknown trap)",
+		"x87 FPU Floating-Point Error",
+		"Alignment Check",
+		"Machine-Check",
+		"SIMD Floating-Point Exception"
+	};
+
+	if (trapno < ARRAY_SIZE(excnames))
+		return excnames[trapno];
+	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
+		return "Hardware Interrupt";
+	return "(unknown trap)";
+}
+
+
+void
+trap_init(void)
+{
+	// (trap number, handler) pairs emitted by kern/trapentry.S,
+	// terminated by a pair with a null handler.
+	extern struct {
+		uint32_t num;
+		void (*handler)(void);
+	} trap_vectors[];
+	int i;
+
+	for (i = 0; trap_vectors[i].handler; i++)
+		SETGATE(idt[trap_vectors[i].num], 0, GD_KT,
+			trap_vectors[i].handler, 0);
+
+	// Per-CPU setup
+	trap_init_percpu();
+}
+
+// Load the kernel's GDT and IDT on this CPU, with this CPU's task
+// state segment and per-CPU data segment.
+void
+trap_init_percpu(void)
+{
+	struct CpuInfo *c = cpu_lookup();
+	int i = c - cpus;
+
+	// Setup a TSS so that we get the right stack when we trap to the
+	// kernel: CPU i's stack is mapped below KSTACKTOP by mem_init_mp.
+	c->cpu_self = c;
+	c->cpu_ts.ts_esp0 = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	c->cpu_ts.ts_ss0 = GD_KD;
+	c->cpu_ts.ts_iomb = sizeof(struct Taskstate);
+
+	// Initialize the TSS slot of the gdt.
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) (&c->cpu_ts),
+					sizeof(struct Taskstate) - 1, 0);
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
+
+	// The per-CPU data segment covers just this CPU's CpuInfo, so
+	// thiscpu is a single %fs-relative load.
+	gdt[(GD_CPU0 >> 3) + i] = SEG16(STA_W, (uint32_t) c,
+					sizeof(struct CpuInfo) - 1, 0);
+
+	lgdt(&gdt_pd);
+	// The kernel never uses GS, so we leave it set to the user data
+	// segment.  FS holds the per-CPU data segment.
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%fs" : : "a" (GD_CPU0 + (i << 3)));
+	// The kernel does use ES, DS, and SS.  We'll change between
+	// the kernel and user data segments as needed.
+	asm volatile("movw %%ax,%%es" : : "a" (GD_KD));
+	asm volatile("movw %%ax,%%ds" : : "a" (GD_KD));
+	asm volatile("movw %%ax,%%ss" : : "a" (GD_KD));
+	// Load the kernel text segment into CS.
+	asm volatile("ljmp %0,$1f\n 1:\n" : : "i" (GD_KT));
+	// For good measure, clear the local descriptor table (LDT),
+	// since we don't use it.
+	lldt(0);
+
+	// Load the TSS selector (like other segment selectors, the
+	// bottom three bits are special; we leave them 0)
+	ltr(GD_TSS0 + (i << 3));
+
+	lidt(&idt_pd);
+}
+
+void
+print_trapframe(struct Trapframe *tf)
+{
+	cprintf("TRAP frame at %p\n", tf);
+	print_regs(&tf->tf_regs);
+	cprintf("  es   0x----%04x\n", tf->tf_es);
+	cprintf("  ds   0x----%04x\n", tf->tf_ds);
+	cprintf("  trap 0x%08x %s\n", tf->tf_trapno, trapname(tf->tf_trapno));
+	// If this trap was a page fault, print the faulting linear address.
+	if (tf->tf_trapno == T_PGFLT)
+		cprintf("  cr2  0x%08x\n", rcr2());
+	cprintf("  err  0x%08x", tf->tf_err);
+	// For page faults, print decoded fault error code:
+	// U/K=fault occurred in user/kernel mode
+	// W/R=a write/read caused the fault
+	// PR=a protection violation caused the fault (NP=page not present).
+	if (tf->tf_trapno == T_PGFLT)
+		cprintf(" [%s, %s, %s]\n",
+			tf->tf_err & 4 ? "user" : "kernel",
+			tf->tf_err & 2 ? "write" : "read",
+			tf->tf_err & 1 ? "protection" : "not-present");
+	else
+		cprintf("\n");
+	cprintf("  eip  0x%08x\n", tf->tf_eip);
+	cprintf("  cs   0x----%04x\n", tf->tf_cs);
+	cprintf("  flag 0x%08x\n", tf->tf_eflags);
+}
+
+void
+print_regs(struct PushRegs *regs)
+{
+	cprintf("  edi  0x%08x\n", regs->reg_edi);
+	cprintf("  esi  0x%08x\n", regs->reg_esi);
+	cprintf("  ebp  0x%08x\n", regs->reg_ebp);
+	cprintf("  oesp 0x%08x\n", regs->reg_oesp);
+	cprintf("  ebx  0x%08x\n", regs->reg_ebx);
+	cprintf("  edx  0x%08x\n", regs->reg_edx);
+	cprintf("  ecx  0x%08x\n", regs->reg_ecx);
+	cprintf("  eax  0x%08x\n", regs->reg_eax);
+}
+
+static void
+trap_dispatch(struct Trapframe *tf)
+{
+	if (tf->tf_trapno == T_PGFLT) {
+		page_fault_handler(tf);
+		return;
+	}
+
+	// Handle clock interrupts.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
+		prof_tick(tf);
+		return;
+	}
+
+	// Handle keyboard and serial interrupts: they feed cons.buf,
+	// which getchar sleeps on.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
+		kbd_intr();
+		return;
+	}
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL) {
+		serial_intr();
+		return;
+	}
+
+	// Handle spurious interrupts
+	// The hardware sometimes raises these because of noise on the
+	// IRQ line or other reasons. We don't care.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SPURIOUS) {
+		cprintf("Spurious interrupt on irq 7\n");
+		print_trapframe(tf);
+		return;
+	}
+
+	// Unexpected trap: there is no user mode yet, so the kernel is
+	// the culprit.
+	print_trapframe(tf);
+	panic("unhandled trap in kernel");
+}
+
+// Called from _alltraps in kern/trapentry.S with the interrupted state.
+// Returning resumes the interrupted code.
+void
+trap(struct Trapframe *tf)
+{
+	// The environment may have set DF and some versions
+	// of GCC rely on DF being clear
+	asm volatile("cld" ::: "cc");
+
+	// Check that interrupts are disabled.  If this assertion
+	// fails, DO NOT be tempted to fix it by inserting a "cli" in
+	// the interrupt path.
+	assert(!(read_eflags() & FL_IF));
+
+	// The interrupt gate turned interrupts off, and iret will turn
+	// them back on, behind the wrappers' backs.
+	if (tf->tf_eflags & FL_IF)
+		irqsoff_begin();
+	trap_dispatch(tf);
+	if (tf->tf_eflags & FL_IF)
+		irqsoff_end();
+}
+
+void
+page_fault_handler(struct Trapframe *tf)
+{
+	uint32_t fault_va;
+	pde_t *pgdir;
+
+	// Read processor's CR2 register to find the faulting address
+	fault_va = rcr2();
+	pgdir = KADDR(rcr3());
+
+	// A write to a present page may be a copy-on-write page.
+	if ((tf->tf_err & (FEC_WR | FEC_PR)) == (FEC_WR | FEC_PR)
+	    && page_cow_break(pgdir, (void *) fault_va) == 0)
+		return;
+
+	// A not-present page may belong to a demand-zero region.
+	if (!(tf->tf_err & FEC_PR) && region_fault(pgdir, fault_va) == 0)
+		return;
+
+	// There is no user mode yet, so any other fault is a kernel bug.
+	print_trapframe(tf);
+	panic("kernel page fault va %08x ip %08x", fault_va, tf->tf_eip);
+}
@@ -76,16 +76,105 @@ getint(va_list *ap, int lflag)
 }
 
 
+// Print one conversion 'ch' (any of "ceduopsx%"), taking its argument
+// from *ap.  Shared by vprintfmt and vprintfmt_cached.
+static void
+printconv(void (*putch)(int, void*), void *putdat, int ch, va_list *ap,
+	  char padc, int width, int precision, int lflag, int altflag)
+{
+	register const char *p;
+	register int err;
+	unsigned long long num;
+	int base;
+
+	switch (ch) {
+
+	// character
+	case 'c':
+		putch(va_arg(*ap, int), putdat);
+		break;
+
+	// error message
+	case 'e':
+		err = va_arg(*ap, int);
+		if (err < 0)
+			err = -err;
+		if (err >= MAXERROR || (p = error_string[err]) == NULL)
+			printfmt(putch, putdat, "error %d", err);
+		else
+			printfmt(putch, putdat, "%s", p);
+		break;
+
+	// string
+	case 's':
+		if ((p = va_arg(*ap, char *)) == NULL)
+			p = "(null)";
+		if (width > 0 && padc != '-')
+			for (width -= strnlen(p, precision); width > 0; width--)
+				putch(padc, putdat);
+		for (; (ch = *p++) != '\0' && (precision < 0 || --precision >= 0); width--)
+			if (altflag && (ch < ' ' || ch > '~'))
+				putch('?', putdat);
+			else
+				putch(ch, putdat);
+		for (; width > 0; width--)
+			putch(' ', putdat);
+		break;
+
+	// (signed) decimal
+	case 'd':
+		num = getint(ap, lflag);
+		if ((long long) num < 0) {
+			putch('-', putdat);
+			num = -(long long) num;
+		}
+		base = 10;
+		goto number;
+
+	// unsigned decimal
+	case 'u':
+		num = getuint(ap, lflag);
+		base = 10;
+		goto number;
+
+	// (unsigned) octal
+	case 'o':
+		num = getuint(ap, lflag);
+		base = 8;
+		goto number;
+
+	// pointer
+	case 'p':
+		putch('0', putdat);
+		putch('x', putdat);
+		num = (unsigned long long)
+			(uintptr_t) va_arg(*ap, void *);
+		base = 16;
+		goto number;
+
+	// (unsigned) hexadecimal
+	case 'x':
+		num = getuint(ap, lflag);
+		base = 16;
+	number:
+		printnum(putch, putdat, num, base, width, padc);
+		break;
+
+	// escaped '%' character
+	case '%':
+		putch(ch, putdat);
+		break;
+	}
+}
+
 // Main function to format and print a string.
 void printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...);
 
 void
 vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 {
-	register const char *p;
-	register int ch, err;
-	unsigned long long num;
-	int base, lflag, width, precision, altflag;
+	register int ch;
+	int lflag, width, precision, altflag;
 	char padc;
 
 	while (1) {
@@ -155,81 +244,17 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 			lflag++;
 			goto reswitch;
 
-		// character
 		case 'c':
-			putch(va_arg(ap, int), putdat);
-			break;
-
-		// error message
 		case 'e':
-			err = va_arg(ap, int);
-			if (err < 0)
-				err = -err;
-			if (err >= MAXERROR || (p = error_string[err]) == NULL)
-				printfmt(putch, putdat, "error %d", err);
-			else
-				printfmt(putch, putdat, "%s", p);
-			break;
-
-		// string
 		case 's':
-			if ((p = va_arg(ap, char *)) == NULL)
-				p = "(null)";
-			if (width > 0 && padc != '-')
-				for (width -= strnlen(p, precision); width > 0; width--)
-					putch(padc, putdat);
-			for (; (ch = *p++) != '\0' && (precision < 0 || --precision >= 0); width--)
-				if (altflag && (ch < ' ' || ch > '~'))
-					putch('?', putdat);
-				else
-					putch(ch, putdat);
-			for (; width > 0; width--)
-				putch(' ', putdat);
-			break;
-
-		// (signed) decimal
 		case 'd':
-			num = getint(&ap, lflag);
-			if ((long long) num < 0) {
-				putch('-', putdat);
-				num = -(long long) num;
-			}
-			base = 10;
-			goto number;
-
-		// unsigned decimal
 		case 'u':
-			num = getuint(&ap, lflag);
-			base = 10;
-			goto number;
-
-		// (unsigned) octal
 		case 'o':
-			// Replace this with your code.
-			num = getuint(&ap, lflag);
-      base = 8;
-      goto number;
-
-		// pointer
 		case 'p':
-			putch('0', putdat);
-			putch('x', putdat);
-			num = (unsigned long long)
-				(uintptr_t) va_arg(ap, void *);
-			base = 16;
-			goto number;
-
-		// (unsigned) hexadecimal
 		case 'x':
-			num = getuint(&ap, lflag);
-			base = 16;
-		number:
-			printnum(putch, putdat, num, base, width, padc);
-			break;
-
-		// escaped '%' character
 		case '%':
-			putch(ch, putdat);
+			printconv(putch, putdat, ch, &ap,
+				  padc, width, precision, lflag, altflag);
 			break;
 
 		// unrecognized escape sequence - just print it literally
@@ -242,6 +267,131 @@ vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
 	}
 }
 
+// Split fc->fmt into literal spans and conversions, following the same
+// rules as vprintfmt.  Formats that need run-time parsing ('*' widths,
+// unrecognized escapes) or have more than FMT_MAXSEGS pieces are marked
+// with nsegs = -1 so that vprintfmt_cached falls back to vprintfmt.
+static void
+fmt_parse(struct Fmtcache *fc)
+{
+	const char *fmt = fc->fmt, *lit;
+	struct Fmtseg *seg;
+	int ch, n = 0;
+
+	while (1) {
+		for (lit = fmt; *fmt != '\0' && *fmt != '%'; fmt++)
+			/* do nothing */;
+		if (fmt > lit) {
+			if (n == FMT_MAXSEGS)
+				goto fallback;
+			seg = &fc->segs[n++];
+			seg->lit = lit;
+			seg->len = fmt - lit;
+		}
+		if (*fmt++ == '\0')
+			break;
+
+		if (n == FMT_MAXSEGS)
+			goto fallback;
+		seg = &fc->segs[n++];
+		seg->lit = NULL;
+		seg->padc = ' ';
+		seg->width = -1;
+		seg->precision = -1;
+		seg->lflag = 0;
+		seg->altflag = 0;
+	reswitch:
+		switch (ch = *(unsigned char *) fmt++) {
+		case '-':
+		case '0':
+			seg->padc = ch;
+			goto reswitch;
+
+		case '1':
+		case '2':
+		case '3':
+		case '4':
+		case '5':
+		case '6':
+		case '7':
+		case '8':
+		case '9':
+			for (seg->precision = 0; ; ++fmt) {
+				seg->precision = seg->precision * 10 + ch - '0';
+				ch = *fmt;
+				if (ch < '0' || ch > '9')
+					break;
+			}
+			if (seg->width < 0)
+				seg->width = seg->precision, seg->precision = -1;
+			goto reswitch;
+
+		case '.':
+			if (seg->width < 0)
+				seg->width = 0;
+			goto reswitch;
+
+		case '#':
+			seg->altflag = 1;
+			goto reswitch;
+
+		case 'l':
+			seg->lflag++;
+			goto reswitch;
+
+		case 'c':
+		case 'e':
+		case 's':
+		case 'd':
+		case 'u':
+		case 'o':
+		case 'p':
+		case 'x':
+		case '%':
+			seg->conv = ch;
+			break;
+
+		default:
+			goto fallback;
+		}
+	}
+	fc->nsegs = n;
+	return;
+
+fallback:
+	fc->nsegs = -1;
+}
+
+// Like vprintfmt, but formats from the pre-parsed segment list in 'fc',
+// parsing fc->fmt on the first call.  Literal spans are handed to
+// 'putspan' in one call each when it is non-NULL.
+void
+vprintfmt_cached(void (*putch)(int, void*), void (*putspan)(const char*, size_t, void*),
+		 void *putdat, struct Fmtcache *fc, va_list ap)
+{
+	struct Fmtseg *seg, *eseg;
+	int i;
+
+	if (fc->nsegs == 0)
+		fmt_parse(fc);
+	if (fc->nsegs < 0) {
+		vprintfmt(putch, putdat, fc->fmt, ap);
+		return;
+	}
+
+	for (seg = fc->segs, eseg = seg + fc->nsegs; seg < eseg; seg++) {
+		if (seg->lit == NULL)
+			printconv(putch, putdat, seg->conv, &ap, seg->padc,
+				  seg->width, seg->precision, seg->lflag,
+				  seg->altflag);
+		else if (putspan)
+			putspan(seg->lit, seg->len, putdat);
+		else
+			for (i = 0; i < seg->len; i++)
+				putch(seg->lit[i], putdat);
+	}
+}
+
 void
 printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...)
 {
@@ -17,7 +17,11 @@ readline(const char *prompt)
 	while (1) {
 		c = getchar();
 		if (c < 0) {
+			// %e is JOS's error-code conversion, not printf's double.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat"
 			cprintf("read error: %e\n", c);
+#pragma GCC diagnostic pop
 			return NULL;
 		} else if ((c == '\b' || c == '\x7f') && i > 0) {
 			if (echoing)